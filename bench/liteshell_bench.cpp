@@ -0,0 +1,410 @@
+// Benchmarks for the shell's command path: spawn rate, parsing and glob
+// expansion, pipeline throughput and history operations. The shell's own
+// source is compiled in, so the benchmarks run exactly the code it does.
+//
+//   g++ -std=c++17 -O2 -Wall bench/liteshell_bench.cpp -o liteshell_bench -lreadline
+//   ./liteshell_bench [--quick] [--repeats N] [--filter NAME] > results.json
+//
+// Every benchmark does a fixed amount of work, with fixed inputs, REPEATS
+// times and reports the median, so results from two builds on the same
+// machine can be compared directly.
+
+#define LITESHELL_NO_MAIN
+#include "../liteshell.cpp"
+
+#include <sys/utsname.h>
+
+namespace {
+
+struct BenchResult {
+    string name;
+    string unit;
+    uint64_t iterations;
+    double amount;      // units of work per run, e.g. bytes or commands
+    vector<double> seconds;
+};
+
+struct BenchOptions {
+    bool quick = false;
+    int repeats = 5;
+    string filter;
+};
+
+// Deterministic input generation, independent of the C library's rand()
+class Lcg {
+public:
+    explicit Lcg(uint64_t seed) : state(seed) {}
+    uint32_t next() {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return static_cast<uint32_t>(state >> 33);
+    }
+
+private:
+    uint64_t state;
+};
+
+double elapsed(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+template <typename F>
+BenchResult run_bench(const BenchOptions &options, const string &name, const string &unit,
+                      uint64_t iterations, double amount, F body) {
+    BenchResult result{name, unit, iterations, amount, {}};
+    for (int r = 0; r < options.repeats; r++) {
+        auto start = chrono::steady_clock::now();
+        body();
+        result.seconds.push_back(elapsed(start));
+    }
+    return result;
+}
+
+double median(vector<double> values) {
+    sort(values.begin(), values.end());
+    size_t n = values.size();
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// A line of many words where every fourth one is a glob
+string long_glob_line(size_t words) {
+    static const char *const parts[] = {"src/*.c", "file.txt", "-v", "\"quoted arg\""};
+    string line = "echo";
+    for (size_t i = 0; i < words; i++) {
+        line += ' ';
+        line += parts[i % 4];
+        if (i % 4 == 1) line += to_string(i);
+    }
+    return line;
+}
+
+string history_command(Lcg &rng) {
+    static const char *const verbs[] = {"git", "make", "ls", "grep", "cat", "ssh", "docker", "vim"};
+    static const char *const args[] = {"status", "-la", "build", "src/main.cpp", "--color", "prod-01",
+                                       "run", "logs", "TODO", "-j8"};
+    string command = verbs[rng.next() % 8];
+    int count = 1 + rng.next() % 4;
+    for (int i = 0; i < count; i++) {
+        command += ' ';
+        command += args[rng.next() % 10];
+    }
+    command += ' ';
+    command += to_string(rng.next() % 1000);
+    return command;
+}
+
+// Temporary directory of empty files for the glob benchmarks
+string make_glob_dir(int files) {
+    char dir[] = "/tmp/liteshell_bench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    string src = string(dir) + "/src";
+    mkdir(src.c_str(), 0755);
+    for (int i = 0; i < files; i++) {
+        string path = src + "/f" + to_string(i) + (i % 2 ? ".c" : ".h");
+        close(open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    }
+    return dir;
+}
+
+void remove_glob_dir(const string &dir, int files) {
+    string src = dir + "/src";
+    for (int i = 0; i < files; i++) {
+        unlink((src + "/f" + to_string(i) + (i % 2 ? ".c" : ".h")).c_str());
+    }
+    rmdir(src.c_str());
+    rmdir(dir.c_str());
+}
+
+void print_json(const BenchOptions &options, const vector<BenchResult> &results) {
+    struct utsname uts;
+    uname(&uts);
+    cout << "{\n"
+         << "  \"liteshell_bench\": 1,\n"
+         << "  \"quick\": " << (options.quick ? "true" : "false") << ",\n"
+         << "  \"repeats\": " << options.repeats << ",\n"
+         << "  \"system\": {\"sysname\": \"" << uts.sysname << "\", \"release\": \"" << uts.release
+         << "\", \"machine\": \"" << uts.machine << "\", \"cpus\": " << thread::hardware_concurrency()
+         << "},\n"
+         << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult &r = results[i];
+        double med = median(r.seconds);
+        char line[512];
+        snprintf(line, sizeof(line),
+                 "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"iterations\": %llu, "
+                 "\"median_seconds\": %.6f, \"min_seconds\": %.6f, \"max_seconds\": %.6f, \"rate\": %.2f}",
+                 i ? "," : "", r.name.c_str(), r.unit.c_str(), static_cast<unsigned long long>(r.iterations),
+                 med, *min_element(r.seconds.begin(), r.seconds.end()),
+                 *max_element(r.seconds.begin(), r.seconds.end()), med > 0 ? r.amount / med : 0);
+        cout << line;
+    }
+    cout << "\n  ]\n}" << endl;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--quick") {
+            options.quick = true;
+        } else if (arg == "--repeats" && i + 1 < argc) {
+            options.repeats = max(1, atoi(argv[++i]));
+        } else if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else {
+            cerr << "usage: " << argv[0] << " [--quick] [--repeats N] [--filter NAME]" << endl;
+            return 2;
+        }
+    }
+
+    // Run commands the way a script does
+    signal(SIGPIPE, SIG_IGN);
+    shell_pid = getpid();
+    interactive = false;
+    init_sigchld();
+    init_job_control();
+
+    auto wanted = [&](const string &name) {
+        return options.filter.empty() || name.find(options.filter) != string::npos;
+    };
+    uint64_t scale = options.quick ? 1 : 10;
+    vector<BenchResult> results;
+
+    // Spawn benchmarks name /bin/true, since true itself is a builtin
+    if (wanted("spawn_true")) {
+        uint64_t n = 200 * scale;
+        results.push_back(run_bench(options, "spawn_true", "commands/s", n, n, [&] {
+            for (uint64_t i = 0; i < n; i++) run_line("/bin/true");
+        }));
+    }
+
+    if (wanted("spawn_pipeline")) {
+        uint64_t n = 100 * scale;
+        results.push_back(run_bench(options, "spawn_pipeline", "pipelines/s", n, n, [&] {
+            for (uint64_t i = 0; i < n; i++) run_line("/bin/true | /bin/true | /bin/true");
+        }));
+    }
+
+    if (wanted("spawn_env_prefix")) {
+        // Prefix assignments reuse the shared environment block
+        uint64_t n = 200 * scale;
+        results.push_back(run_bench(options, "spawn_env_prefix", "commands/s", n, n, [&] {
+            for (uint64_t i = 0; i < n; i++) run_line("FOO=1 BAR=$FOO /bin/true");
+        }));
+    }
+
+    if (wanted("subst_builtin")) {
+        // $(pwd) runs in-process, with no fork or pipe
+        uint64_t n = 20000 * scale;
+        results.push_back(run_bench(options, "subst_builtin", "substitutions/s", n, n, [&] {
+            for (uint64_t i = 0; i < n; i++) run_line("DIR=$(pwd)");
+        }));
+    }
+
+    if (wanted("loop_compiled")) {
+        // A loop body is compiled once and re-run, never re-parsed
+        uint64_t n = 20000 * scale;
+        string loop = "i=0; for i in";
+        for (uint64_t i = 0; i < n; i++) loop += " w";
+        loop += "; do X=$i; if pwd > /dev/null; then Y=$X; fi; done";
+        results.push_back(run_bench(options, "loop_compiled", "iterations/s", 1, n, [&] {
+            run_line(loop);
+        }));
+    }
+
+    if (wanted("loop_test")) {
+        // [ ... ] and echo are builtins, so a condition-heavy loop never forks
+        uint64_t n = 20000 * scale;
+        string loop = "for i in";
+        for (uint64_t i = 0; i < n; i++) loop += " w";
+        loop += "; do if [ -n $i -a $i != x ]; then echo $i > /dev/null; fi; done";
+        results.push_back(run_bench(options, "loop_test", "iterations/s", 1, n, [&] {
+            run_line(loop);
+        }));
+    }
+
+    if (wanted("builtin_redirected")) {
+        uint64_t n = 2000 * scale;
+        results.push_back(run_bench(options, "builtin_redirected", "commands/s", n, n, [&] {
+            for (uint64_t i = 0; i < n; i++) run_line("pwd > /dev/null");
+        }));
+    }
+
+    string line = long_glob_line(4096);
+    if (wanted("parse_long_line")) {
+        // Lexing and AST building without the cache
+        uint64_t n = 50 * scale;
+        results.push_back(run_bench(options, "parse_long_line", "MB/s", n,
+                                    static_cast<double>(n) * line.size() / 1e6, [&] {
+            for (uint64_t i = 0; i < n; i++) {
+                ParsedCommand parsed;
+                parse_command(line, parsed.line);
+                parse_list(parsed.line.tokens, parsed.list, parsed.incomplete);
+            }
+        }));
+    }
+
+    if (wanted("parse_cached")) {
+        uint64_t n = 100000 * scale;
+        results.push_back(run_bench(options, "parse_cached", "lookups/s", n, n, [&] {
+            for (uint64_t i = 0; i < n; i++) parse_cached(line);
+        }));
+    }
+
+    if (wanted("glob_expand")) {
+        // 1024 glob words over a 2000-file directory, as run each time the
+        // line executes; the directory listing cache is warm after the first
+        const int files = 2000;
+        string dir = make_glob_dir(files);
+        char cwd[PATH_MAX];
+        if (!getcwd(cwd, sizeof(cwd)) || chdir(dir.c_str()) != 0) {
+            perror("chdir");
+            return 1;
+        }
+        ParsedCommand parsed;
+        parse_command(long_glob_line(4096), parsed.line);
+        parse_list(parsed.line.tokens, parsed.list, parsed.incomplete);
+        const Stage &stage = parsed.list.items[0].items[0].pipeline.stages[0];
+        uint64_t n = 2 * scale;
+        results.push_back(run_bench(options, "glob_expand", "words/s", n,
+                                    static_cast<double>(n) * stage.words.size(), [&] {
+            for (uint64_t i = 0; i < n; i++) {
+                vector<string_view> argv;
+                deque<string> storage;
+                expand_words(stage.words, argv, storage);
+            }
+        }));
+        if (chdir(cwd) != 0) perror("chdir");
+        remove_glob_dir(dir, files);
+    }
+
+    if (wanted("complete_command")) {
+        // Command-name completion against a 5000-entry PATH directory; the
+        // index is built once and each Tab is a binary search into it
+        const int files = 5000;
+        string dir = make_glob_dir(files);
+        for (int i = 0; i < files; i++) {
+            chmod((dir + "/src/f" + to_string(i) + (i % 2 ? ".c" : ".h")).c_str(), 0755);
+        }
+        string saved_path = *shell_vars.get("PATH");
+        shell_vars.set("PATH", dir + "/src");
+        refresh_path_index(chrono::milliseconds(10000));
+        uint64_t n = 20000 * scale;
+        results.push_back(run_bench(options, "complete_command", "completions/s", n, n, [&] {
+            bool filenames;
+            for (uint64_t i = 0; i < n; i++) completion_candidates("f12", 0, "f12", filenames);
+        }));
+        shell_vars.set("PATH", saved_path);
+        remove_glob_dir(dir, files);
+    }
+
+    if (wanted("pipeline_cat3")) {
+        uint64_t bytes = (options.quick ? 64ULL : 512ULL) << 20;
+        string command = "head -c " + to_string(bytes) + " /dev/zero | cat | cat | cat > /dev/null";
+        results.push_back(run_bench(options, "pipeline_cat3", "MB/s", 1, bytes / 1e6, [&] {
+            run_line(command);
+        }));
+    }
+
+    if (wanted("history_add")) {
+        // Fill a default-sized ring ten times over, indexing each entry
+        uint64_t n = DEFAULT_HISTORY * scale;
+        results.push_back(run_bench(options, "history_add", "entries/s", n, n, [&] {
+            HistoryRing ring(DEFAULT_HISTORY);
+            HistoryIndex index;
+            Lcg rng(42);
+            for (uint64_t i = 0; i < n; i++) {
+                ring.push(history_command(rng));
+                index.add(ring.end_seq() - 1, ring.back());
+            }
+        }));
+    }
+
+    if (wanted("history_search")) {
+        HistoryRing ring(DEFAULT_HISTORY);
+        HistoryIndex index;
+        Lcg rng(42);
+        for (int i = 0; i < 3 * DEFAULT_HISTORY; i++) {
+            ring.push(history_command(rng));
+            index.add(ring.end_seq() - 1, ring.back());
+        }
+        static const char *const patterns[] = {"git status", "src/main", "prod", "make -j8", "logs 9"};
+        uint64_t n = 5000 * scale;
+        results.push_back(run_bench(options, "history_search", "searches/s", n, n, [&] {
+            for (uint64_t i = 0; i < n; i++) {
+                index.search(ring, patterns[i % 5], i % 2 == 0, DEFAULT_HISTORY);
+            }
+        }));
+    }
+
+    if (wanted("history_load")) {
+        // Startup load of the newest DEFAULT_HISTORY entries from a 1M-entry log
+        char path[] = "/tmp/liteshell_bench_history.XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            perror("mkstemp");
+            return 1;
+        }
+        Lcg rng(42);
+        string log;
+        for (int i = 0; i < 1000000; i++) log += HistoryStore::encode(history_command(rng));
+        if (write(fd, log.data(), log.size()) != (ssize_t)log.size()) perror("write");
+        close(fd);
+        uint64_t n = 100 * scale;
+        results.push_back(run_bench(options, "history_load", "loads/s", n, n, [&] {
+            for (uint64_t i = 0; i < n; i++) {
+                HistoryStore store;
+                store.open(path);
+                store.load(DEFAULT_HISTORY);
+            }
+        }));
+        unlink(path);
+    }
+
+    if (wanted("rc_run") || wanted("rc_snapshot")) {
+        // Startup with an rc of 40 aliases, 20 exports and 10 functions,
+        // run each time or loaded from its snapshot
+        char home[] = "/tmp/liteshell_bench_home.XXXXXX";
+        if (!mkdtemp(home)) {
+            perror("mkdtemp");
+            return 1;
+        }
+        string rc;
+        for (int i = 0; i < 40; i++) rc += "alias a" + to_string(i) + "='ls -l dir" + to_string(i) + "'\n";
+        for (int i = 0; i < 20; i++) rc += "export V" + to_string(i) + "=/opt/tool" + to_string(i) + "/bin\n";
+        for (int i = 0; i < 10; i++) {
+            rc += "f" + to_string(i) + "() {\n    if [ -n \"$1\" ]; then echo \"$1\"; fi\n}\n";
+        }
+        string rc_file = string(home) + "/.liteshellrc";
+        int fd = open(rc_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (write(fd, rc.data(), rc.size()) != (ssize_t)rc.size()) perror("write");
+        close(fd);
+        string saved_home = getenv("HOME") ? getenv("HOME") : "";
+        setenv("HOME", home, 1);
+        uint64_t n = 200 * scale;
+        if (wanted("rc_run")) {
+            shell_vars.set("LITESHELL_SNAPSHOT", "off");
+            results.push_back(run_bench(options, "rc_run", "startups/s", n, n, [&] {
+                for (uint64_t i = 0; i < n; i++) load_rc();
+            }));
+            shell_vars.unset("LITESHELL_SNAPSHOT");
+        }
+        if (wanted("rc_snapshot")) {
+            load_rc();
+            results.push_back(run_bench(options, "rc_snapshot", "startups/s", n, n, [&] {
+                for (uint64_t i = 0; i < n; i++) load_rc();
+            }));
+        }
+        setenv("HOME", saved_home.c_str(), 1);
+        unlink((string(home) + "/.liteshellrc.snapshot").c_str());
+        unlink(rc_file.c_str());
+        rmdir(home);
+    }
+
+    print_json(options, results);
+    return 0;
+}
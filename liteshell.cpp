@@ -9,45 +9,937 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unordered_map>
+#include <string_view>
+#include <memory>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <poll.h>
+#include <array>
+#include <cstdint>
 #include <sys/stat.h>
+#include <climits>
+#include <cmath>
+#include <pwd.h>
+#include <grp.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <signal.h>
 #include <termios.h>
+#include <cerrno>
+#include <spawn.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <functional>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
 
 using namespace std;
 
+// Token kinds produced by the lexer
+enum class TokenKind {
+    Word,
+    Pipe,       // |
+    OrIf,       // ||
+    Amp,        // &
+    AndIf,      // &&
+    Semi,       // ;
+    Newline,    // a line break inside multi-line input
+    // Redirections; any of them may carry a leading fd number
+    Less,       // <
+    Great,      // >
+    DGreat,     // >>
+    LessAnd,    // <&
+    GreatAnd,   // >&
+    AndGreat,   // &>
+    AndDGreat,  // &>>
+    DLess,      // <<
+    DLessDash,  // <<-
+    TLess       // <<<
+};
+
+// A token's text is either a static operator spelling or a NUL-terminated
+// word in the owning CommandLine's arena, so argv can point straight at it.
+struct Token {
+    TokenKind kind;
+    string_view text;
+    bool glob;
+    // For glob words containing quoted characters: the pattern with those
+    // characters backslash-escaped. Empty means text is the pattern.
+    string_view pattern;
+    // Words with any quoting are never alias-expanded
+    bool quoted = false;
+    // Redirections: the fd number written before the operator, or -1
+    int io_number = -1;
+    // Here-document operators: the document text
+    string_view body;
+    // Words with an unquoted or double-quoted '$': the word's source text,
+    // from which the word is rebuilt each time the command runs
+    string_view source;
+    // A NAME=value word with NAME unquoted
+    bool assignment = false;
+};
+
+// Bump allocator for token text. Words are stored contiguously and
+// NUL-terminated; a word that outgrows its block is moved to a larger one.
+class Arena {
+public:
+    static const size_t BLOCK_SIZE = 4096;
+
+    Arena() : cur(nullptr), end(nullptr), word(nullptr) {}
+    Arena(const Arena&) = delete;
+    Arena &operator=(const Arena&) = delete;
+
+    void reserve(size_t size) {
+        if (static_cast<size_t>(end - cur) < size) {
+            new_block(max(size, BLOCK_SIZE), 0);
+        }
+    }
+
+    void begin_word() {
+        if (cur == end) {
+            new_block(BLOCK_SIZE, 0);
+        }
+        word = cur;
+    }
+
+    void push(char c) {
+        if (cur == end) grow();
+        *cur++ = c;
+    }
+
+    string_view end_word() {
+        if (cur == end) grow();
+        *cur++ = '\0';
+        return string_view(word, cur - word - 1);
+    }
+
+private:
+    void grow() {
+        size_t len = cur - word;
+        new_block(max(BLOCK_SIZE, 2 * len + 16), len);
+    }
+
+    void new_block(size_t size, size_t keep) {
+        unique_ptr<char[]> block(new char[size]);
+        if (keep) {
+            memcpy(block.get(), word, keep);
+        }
+        word = block.get();
+        cur = word + keep;
+        end = word + size;
+        blocks.push_back(move(block));
+    }
+
+    vector<unique_ptr<char[]>> blocks;
+    char *cur;
+    char *end;
+    char *word;
+};
+
+// One lexed input line. Tokens reference the arena, the expansions deque
+// for words produced by wildcard expansion, or an alias body held in pins,
+// and stay valid while it lives.
+struct CommandLine {
+    Arena arena;
+    vector<Token> tokens;
+    deque<string> expansions;
+    vector<shared_ptr<const void>> pins;
+    // Set when a here-document has not reached its delimiter yet; the
+    // missing delimiters are listed so callers can read more input
+    bool incomplete = false;
+    vector<string_view> open_heredocs;
+};
+
+// Parsed form of a command line: a pipeline of stages, each with its words
+// and redirections. Words keep their lexed form; glob words are expanded
+// each time the pipeline runs, so a parsed command can be reused.
+struct Redirect {
+    TokenKind kind;
+    int fd;                     // the descriptor being redirected
+    Token target;               // file, fd number or here-document delimiter
+    string_view body;           // here-documents only
+};
+
+struct Stage {
+    vector<Token> words;
+    vector<string_view> argv;   // word texts, used as-is when nothing expands
+    bool expands = false;
+    vector<Redirect> redirects; // applied in order after the pipe ends
+    vector<Token> assignments;  // leading NAME=value words
+};
+
+struct Pipeline {
+    vector<Stage> stages;
+    bool background = false;
+    bool timed = false;         // prefixed with "time"
+    string text;                // command text shown by jobs
+};
+
+// Command lists: pipelines chained with && and ||, several chains separated
+// by ; & or newlines, parallel blocks whose jobs are such chains, and the
+// compound commands built from lists
+struct ParallelBlock;
+struct CompoundCommand;
+
+struct ChainItem {
+    TokenKind op = TokenKind::Semi;     // AndIf or OrIf joining it to the previous item
+    Pipeline pipeline;
+    shared_ptr<ParallelBlock> parallel; // set instead of pipeline for a block
+    shared_ptr<CompoundCommand> compound;   // or for if, while, for, { } and functions
+};
+
+struct AndOrList {
+    vector<ChainItem> items;
+    bool background = false;
+    string text;
+};
+
+struct CommandList {
+    vector<AndOrList> items;
+};
+
+struct ParallelBlock {
+    int max_jobs = 0;                   // 0 means one per CPU
+    vector<AndOrList> jobs;
+};
+
+enum class CompoundKind { If, While, Until, For, Group, Function };
+
+struct CompoundCommand {
+    CompoundKind kind = CompoundKind::Group;
+    vector<CommandList> conditions;     // If: one per if/elif; While, Until: one
+    vector<CommandList> bodies;         // If: one per condition, then any else
+    string name;                        // For: the variable; Function: its name
+    vector<Token> words;                // For: the words after "in"
+    bool has_words = false;             // For: "in" was given
+};
+
+// A command list compiled into a tree of closures. Each node is folded once,
+// when the line is parsed, so a loop body runs again without re-parsing or
+// dispatching on node kinds.
+using Program = function<int()>;
+
+struct ParsedCommand {
+    string text;                // the input it was parsed from
+    CommandLine line;           // owns all the text the list refers to
+    CommandList list;
+    Program program;            // list compiled, refers into list
+    // The input stops where more is expected, e.g. after && or in a block
+    bool incomplete = false;
+};
+
+// Fixed-capacity command history. Index 0 is the oldest entry; once full,
+// each push overwrites the oldest slot instead of shifting the rest.
+class HistoryRing {
+public:
+    explicit HistoryRing(size_t capacity) : entries(capacity), head(0), count(0), pushed(0) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t capacity() const { return entries.size(); }
+
+    const string &operator[](size_t i) const {
+        return entries[(head + i) % entries.size()];
+    }
+
+    const string &back() const {
+        return (*this)[count - 1];
+    }
+
+    // Every entry ever pushed has a sequence number; these stay stable while
+    // the ring rotates, unlike indexes
+    uint64_t first_seq() const { return pushed - count; }
+    uint64_t end_seq() const { return pushed; }
+
+    const string &at_seq(uint64_t seq) const {
+        return (*this)[seq - first_seq()];
+    }
+
+    void push(const string &command) {
+        if (count < entries.size()) {
+            entries[(head + count) % entries.size()] = command;
+            count++;
+        } else {
+            entries[head] = command;
+            head = (head + 1) % entries.size();
+        }
+        pushed++;
+    }
+
+private:
+    vector<string> entries;
+    size_t head;
+    size_t count;
+    uint64_t pushed;
+};
+
+// Trigram index over the history ring. Each trigram maps to the ascending
+// sequence numbers of the entries containing it; entries that have left the
+// ring are pruned in bulk once per ring's worth of inserts.
+class HistoryIndex {
+public:
+    void add(uint64_t seq, const string &command) {
+        vector<uint32_t> grams = trigrams(command);
+        for (uint32_t gram : grams) {
+            postings[gram].push_back(seq);
+        }
+        if (++inserts_since_prune >= prune_interval) {
+            prune_pending = true;
+        }
+    }
+
+    // Newest-first sequence numbers of entries containing pattern (or
+    // starting with it, if prefix), at most limit of them
+    vector<uint64_t> search(const HistoryRing &ring, const string &pattern, bool prefix,
+                            size_t limit, uint64_t before = UINT64_MAX) {
+        if (prune_pending) {
+            prune(ring.first_seq());
+        }
+
+        vector<uint64_t> results;
+        uint64_t first = ring.first_seq();
+        uint64_t last = min(before, ring.end_seq());
+
+        auto matches = [&](uint64_t seq) {
+            const string &command = ring.at_seq(seq);
+            return prefix ? command.compare(0, pattern.size(), pattern) == 0
+                          : command.find(pattern) != string::npos;
+        };
+
+        if (pattern.size() < 3) {
+            // Too short for a trigram; scan the ring directly
+            for (uint64_t seq = last; seq > first && results.size() < limit; seq--) {
+                if (matches(seq - 1)) results.push_back(seq - 1);
+            }
+            return results;
+        }
+
+        // Walk the shortest posting list and check candidates against the
+        // next shortest ones before comparing the text itself
+        vector<const vector<uint64_t>*> lists;
+        for (uint32_t gram : trigrams(pattern)) {
+            auto it = postings.find(gram);
+            if (it == postings.end()) {
+                return results;
+            }
+            lists.push_back(&it->second);
+        }
+        sort(lists.begin(), lists.end(), [](const vector<uint64_t> *a, const vector<uint64_t> *b) {
+            return a->size() < b->size();
+        });
+
+        const vector<uint64_t> &shortest = *lists[0];
+        auto it = lower_bound(shortest.begin(), shortest.end(), last);
+        while (it != shortest.begin() && results.size() < limit) {
+            uint64_t seq = *--it;
+            if (seq < first) break;
+            bool candidate = true;
+            for (size_t i = 1; i < lists.size() && i < 3; i++) {
+                if (!binary_search(lists[i]->begin(), lists[i]->end(), seq)) {
+                    candidate = false;
+                    break;
+                }
+            }
+            if (candidate && matches(seq)) {
+                results.push_back(seq);
+            }
+        }
+        return results;
+    }
+
+    void set_prune_interval(size_t interval) {
+        prune_interval = interval;
+    }
+
+private:
+    static vector<uint32_t> trigrams(const string &text) {
+        vector<uint32_t> grams;
+        for (size_t i = 0; i + 2 < text.size(); i++) {
+            grams.push_back((uint32_t)(unsigned char)text[i] << 16 |
+                            (uint32_t)(unsigned char)text[i + 1] << 8 |
+                            (uint32_t)(unsigned char)text[i + 2]);
+        }
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+
+    void prune(uint64_t first_seq) {
+        for (auto it = postings.begin(); it != postings.end(); ) {
+            vector<uint64_t> &list = it->second;
+            list.erase(list.begin(), lower_bound(list.begin(), list.end(), first_seq));
+            if (list.empty()) {
+                it = postings.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        inserts_since_prune = 0;
+        prune_pending = false;
+    }
+
+    unordered_map<uint32_t, vector<uint64_t>> postings;
+    size_t inserts_since_prune = 0;
+    size_t prune_interval = 1024;
+    bool prune_pending = false;
+};
+
+// Shared on-disk history: an append-only log that every session writes with
+// O_APPEND, one write() per record, so concurrent sessions never overwrite
+// each other. A record is framed as
+//     "\x1eLSH" length hash | command | length "LSH\x1f"
+// with 32-bit length and FNV-1a hash. The trailer lets load() walk back
+// from the end of the mapped file, so only the newest entries are read
+// however long the log is; a record that fails its checks (a torn write)
+// makes it rescan from the front and resynchronize on the next header.
+// Past COMPACT_BYTES the log is rewritten with its newest KEEP records
+// under an exclusive flock. Appends hold a shared one and reopen the file
+// if it has been replaced meanwhile.
+class HistoryStore {
+public:
+    static const size_t COMPACT_BYTES = 64 << 20;
+    static const size_t KEEP = 100000;
+
+    ~HistoryStore() {
+        if (fd != -1) ::close(fd);
+    }
+
+    bool open(const string &file) {
+        path = file;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        return fd != -1;
+    }
+
+    // The newest limit commands, oldest first
+    vector<string> load(size_t limit) {
+        vector<string> commands;
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) != 0 || st.st_size == 0) return commands;
+        void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) return commands;
+        for (string_view command : newest(string_view((const char *)map, st.st_size), limit)) {
+            commands.emplace_back(command);
+        }
+        munmap(map, st.st_size);
+        return commands;
+    }
+
+    bool append(const string &command) {
+        if (!lock(LOCK_SH)) return false;
+        string record = encode(command);
+        bool ok = write(fd, record.data(), record.size()) == (ssize_t)record.size();
+        struct stat st;
+        bool full = ok && fstat(fd, &st) == 0 && (size_t)st.st_size > COMPACT_BYTES;
+        flock(fd, LOCK_UN);
+        if (full) compact();
+        return ok;
+    }
+
+    // Writes commands as the log's first records, unless another session
+    // has already put something there
+    void import(const vector<string> &commands) {
+        if (!lock(LOCK_EX)) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size == 0) {
+            string buffer;
+            for (const string &command : commands) buffer += encode(command);
+            if (write(fd, buffer.data(), buffer.size()) < 0) perror("history");
+        }
+        flock(fd, LOCK_UN);
+    }
+
+    static string encode(string_view command) {
+        uint32_t length = command.size();
+        uint32_t sum = hash(command);
+        string record;
+        record.reserve(HEADER + command.size() + TRAILER);
+        record.append(HEAD_MAGIC, 4);
+        record.append((const char *)&length, 4);
+        record.append((const char *)&sum, 4);
+        record.append(command);
+        record.append((const char *)&length, 4);
+        record.append(TAIL_MAGIC, 4);
+        return record;
+    }
+
+    // The newest limit records of a log image, oldest first
+    static vector<string_view> newest(string_view data, size_t limit) {
+        vector<string_view> found;
+        size_t end = data.size();
+        while (end > 0 && found.size() < limit) {
+            string_view command;
+            size_t size = record_ending(data, end, command);
+            if (size == 0) return scan(data, limit);
+            found.push_back(command);
+            end -= size;
+        }
+        reverse(found.begin(), found.end());
+        return found;
+    }
+
+private:
+    static constexpr const char *HEAD_MAGIC = "\x1eLSH";
+    static constexpr const char *TAIL_MAGIC = "LSH\x1f";
+    static const size_t HEADER = 12;
+    static const size_t TRAILER = 8;
+
+    string path;
+    int fd = -1;
+
+    static uint32_t hash(string_view text) {
+        uint32_t h = 2166136261u;
+        for (char c : text) h = (h ^ (unsigned char)c) * 16777619u;
+        return h;
+    }
+
+    static uint32_t length_at(string_view data, size_t offset) {
+        uint32_t value;
+        memcpy(&value, data.data() + offset, 4);
+        return value;
+    }
+
+    // Size of the intact record at offset, setting command; 0 if there is none
+    static size_t record_at(string_view data, size_t offset, string_view &command) {
+        if (offset > data.size() || data.size() - offset < HEADER + TRAILER ||
+            memcmp(data.data() + offset, HEAD_MAGIC, 4) != 0) {
+            return 0;
+        }
+        size_t length = length_at(data, offset + 4);
+        if (length > data.size() - offset - HEADER - TRAILER) return 0;
+        size_t tail = offset + HEADER + length;
+        string_view text = data.substr(offset + HEADER, length);
+        if (length_at(data, tail) != length || memcmp(data.data() + tail + 4, TAIL_MAGIC, 4) != 0 ||
+            length_at(data, offset + 8) != hash(text)) {
+            return 0;
+        }
+        command = text;
+        return HEADER + length + TRAILER;
+    }
+
+    // Size of the intact record that ends at end, setting command; 0 if none
+    static size_t record_ending(string_view data, size_t end, string_view &command) {
+        if (end < HEADER + TRAILER) return 0;
+        size_t length = length_at(data, end - TRAILER);
+        if (length > end - HEADER - TRAILER) return 0;
+        return record_at(data.substr(0, end), end - TRAILER - length - HEADER, command);
+    }
+
+    // Front-to-back read that skips damaged bytes up to the next header
+    static vector<string_view> scan(string_view data, size_t limit) {
+        deque<string_view> found;
+        size_t offset = 0;
+        while (offset < data.size()) {
+            string_view command;
+            if (size_t size = record_at(data, offset, command)) {
+                found.push_back(command);
+                if (found.size() > limit) found.pop_front();
+                offset += size;
+            } else {
+                offset = data.find(string_view(HEAD_MAGIC, 4), offset + 1);
+            }
+        }
+        return vector<string_view>(found.begin(), found.end());
+    }
+
+    // Locks the log, first reopening it if a compaction replaced the file
+    bool lock(int operation) {
+        while (fd != -1) {
+            flock(fd, operation);
+            struct stat mine, current;
+            if (fstat(fd, &mine) != 0 || stat(path.c_str(), &current) != 0 ||
+                (mine.st_dev == current.st_dev && mine.st_ino == current.st_ino)) {
+                return true;
+            }
+            ::close(fd);
+            open(path);
+        }
+        return false;
+    }
+
+    void compact() {
+        if (!lock(LOCK_EX)) return;
+        struct stat st;
+        void *map = MAP_FAILED;
+        // Another session may have compacted it first
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size > COMPACT_BYTES) {
+            map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        if (map == MAP_FAILED) {
+            flock(fd, LOCK_UN);
+            return;
+        }
+
+        string buffer;
+        for (string_view command : newest(string_view((const char *)map, st.st_size), KEEP)) {
+            buffer += encode(command);
+        }
+        munmap(map, st.st_size);
+
+        string tmp_file = path + ".tmp." + to_string(getpid());
+        int out = ::open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = out != -1 && write(out, buffer.data(), buffer.size()) == (ssize_t)buffer.size();
+        if (out != -1) ::close(out);
+        if (!ok || rename(tmp_file.c_str(), path.c_str()) != 0) {
+            unlink(tmp_file.c_str());
+        }
+        // Closing drops the lock; waiting sessions then see the new file
+        ::close(fd);
+        open(path);
+    }
+};
+
 // Function prototypes
 void print_prompt();
-vector<string> parse_command(const string &input);
-int execute_command(const vector<string> &args);
-void handle_cd(const vector<string> &args);
-void handle_help();
-void handle_exit();
-void handle_history(const vector<string> &args);
-void handle_pwd();
-void handle_ls(const vector<string> &args);
-void handle_alias(const vector<string> &args);
+void lex_command(const string &input, CommandLine &line);
+void parse_command(const string &input, CommandLine &line);
+bool parse_pipeline(const Token *first, const Token *last, Pipeline &pipeline);
+bool parse_list(const vector<Token> &tokens, CommandList &list, bool &incomplete);
+shared_ptr<const ParsedCommand> parse_cached(const string &input);
+void clear_parse_cache();
+void expand_words(const vector<Token> &words, vector<string_view> &argv, deque<string> &storage);
+int execute_command(const Pipeline &pipeline);
+Program compile_list(const CommandList &list);
+struct Builtin;
+int handle_cd(const vector<string> &args);
+int handle_help(const vector<string> &args);
+int handle_exit(const vector<string> &args);
+int handle_history(const vector<string> &args);
+int handle_pwd(const vector<string> &args);
+int handle_ls(const vector<string> &args);
+int handle_alias(const vector<string> &args);
+int handle_unalias(const vector<string> &args);
+void set_alias(const string &name, const string &value, bool from_rc = false);
+void expand_aliases(CommandLine &line);
+void load_aliases();
+void save_aliases();
+int handle_hash(const vector<string> &args);
+string lookup_command(const string &name);
 void add_to_history(const string &command);
-vector<string> expand_wildcards(const string &pattern);
+vector<string> expand_wildcards(string_view pattern);
 void setup_readline();
+char **complete_line(const char *text, int start, int end);
+void refresh_path_index(chrono::milliseconds wait);
+void load_rc();
+void save_rc_snapshot();
 void reset_terminal();
 void cleanup_terminal();
 void sigint_handler(int sig);
-void execute_pipeline(const vector<vector<string>> &commands);
+// One step of setting up a stage's descriptors, applied in order as
+// dup2(source, target); a source of -1 closes target
+struct FdAction {
+    int target;
+    int source;
+};
+using FdActions = vector<FdAction>;
+// stage_envp, when given, holds an environment per stage or null for the
+// shell's own
+int execute_pipeline(const vector<vector<string_view>> &commands, const vector<FdActions> &stage_fds,
+                     bool background, const string &text, bool timed = false,
+                     const vector<char*const*> *stage_envp = nullptr);
+// Supplies further input lines, e.g. for here-documents; false at EOF
+using MoreInput = function<bool(string &line)>;
+int run_line(string input, const MoreInput &more = nullptr,
+             const function<void(const string &text)> &entered = nullptr);
+int handle_jobs(const vector<string> &args);
+int handle_fg(const vector<string> &args);
+int handle_bg(const vector<string> &args);
+int handle_wait(const vector<string> &args);
+int handle_prompt(const vector<string> &args);
+int handle_pipeconf(const vector<string> &args);
+int handle_timing(const vector<string> &args);
+int handle_trace(const vector<string> &args);
+int handle_jobout(const vector<string> &args);
+int handle_export(const vector<string> &args);
+int handle_unset(const vector<string> &args);
+int handle_break(const vector<string> &args);
+int handle_continue(const vector<string> &args);
+int handle_return(const vector<string> &args);
+int handle_echo(const vector<string> &args);
+int handle_printf(const vector<string> &args);
+int handle_test(const vector<string> &args);
+int handle_true(const vector<string> &args);
+int handle_false(const vector<string> &args);
+void refresh_prompt_cwd();
 
 // Global variables
-vector<string> command_history;
-unordered_map<string, string> aliases;
-const string HISTORY_FILE = ".myshell_history";
-const int MAX_HISTORY = 1000;
+// Entries kept in memory and loaded at startup; HISTSIZE overrides it
+const int DEFAULT_HISTORY = 10000;
+int history_size = DEFAULT_HISTORY;
+HistoryRing command_history(DEFAULT_HISTORY);
+HistoryIndex history_index;
+HistoryStore history_store;
+
+// Alias bodies are lexed once when defined. Expansions are memoized per name
+// and the memo is dropped whenever any alias changes.
+struct Alias {
+    string value;
+    shared_ptr<CommandLine> body;
+    bool from_rc = false;       // defined by ~/.liteshellrc, not saved
+};
+
+struct AliasExpansion {
+    vector<Token> tokens;
+    vector<shared_ptr<const void>> pins;    // bodies the tokens point into
+};
+
+unordered_map<string, Alias> aliases;
+unordered_map<string, shared_ptr<const AliasExpansion>> alias_memo;
+// The alias file is append-only while running; redefinitions leave stale
+// lines behind, so it is rewritten on exit when this is set
+bool aliases_dirty = false;
+const string ALIAS_FILE = ".myshell_aliases";
+
+// Set while ~/.liteshellrc runs: whether its effects can be replayed from
+// a snapshot, and the variables it expanded and changed
+struct RcRecording {
+    bool replayable = true;
+    set<string> reads;
+    set<string> writes;
+};
+RcRecording *rc_recording = nullptr;
+
+// Shell variables. The exported ones make up the environment block passed
+// to posix_spawn. The block is immutable and shared by every spawn until an
+// exported variable changes; only then is a new one built, on next use.
+struct ShellVariable {
+    string value;
+    bool exported = false;
+};
+
+struct EnvironmentBlock {
+    vector<string> entries;     // "NAME=value"
+    vector<char*> envp;         // points into entries, null-terminated
+};
+
+class VariableStore {
+public:
+    VariableStore() {
+        for (char **env = environ; env && *env; env++) {
+            const char *eq = strchr(*env, '=');
+            if (!eq) continue;
+            vars[string(*env, eq - *env)] = {eq + 1, true};
+        }
+    }
+
+    const string *get(const string &name) const {
+        auto it = vars.find(name);
+        return it != vars.end() ? &it->second.value : nullptr;
+    }
+
+    // Sets a variable, keeping its exported flag unless export_it is given
+    void set(const string &name, string value, bool export_it = false) {
+        if (rc_recording) rc_recording->writes.insert(name);
+        ShellVariable &var = vars[name];
+        var.value = move(value);
+        var.exported |= export_it;
+        if (var.exported) block.reset();
+    }
+
+    void export_name(const string &name) {
+        if (rc_recording) rc_recording->writes.insert(name);
+        ShellVariable &var = vars[name];
+        if (!var.exported) {
+            var.exported = true;
+            block.reset();
+        }
+    }
+
+    void unset(const string &name) {
+        if (rc_recording) rc_recording->writes.insert(name);
+        auto it = vars.find(name);
+        if (it == vars.end()) return;
+        if (it->second.exported) block.reset();
+        vars.erase(it);
+    }
+
+    const unordered_map<string, ShellVariable> &all() const { return vars; }
+
+    shared_ptr<const EnvironmentBlock> environment() {
+        if (!block) {
+            auto fresh = make_shared<EnvironmentBlock>();
+            for (const auto &entry : vars) {
+                if (entry.second.exported) {
+                    fresh->entries.push_back(entry.first + "=" + entry.second.value);
+                }
+            }
+            for (auto &entry : fresh->entries) {
+                fresh->envp.push_back(const_cast<char*>(entry.c_str()));
+            }
+            fresh->envp.push_back(nullptr);
+            block = fresh;
+        }
+        return block;
+    }
+
+    // The environment with "NAME=value" overrides, for prefix assignments
+    // like "FOO=1 cmd". Only pointers are copied; pin keeps the block they
+    // point into alive.
+    vector<char*> environment_with(const vector<string> &overrides,
+                                   shared_ptr<const EnvironmentBlock> &pin) {
+        pin = environment();
+        vector<char*> envp;
+        envp.reserve(pin->envp.size() + overrides.size());
+        for (char *entry : pin->envp) {
+            if (!entry) break;
+            bool replaced = false;
+            for (const auto &assign : overrides) {
+                size_t len = assign.find('=') + 1;
+                if (strncmp(entry, assign.c_str(), len) == 0) {
+                    replaced = true;
+                    break;
+                }
+            }
+            if (!replaced) envp.push_back(entry);
+        }
+        for (const auto &assign : overrides) {
+            envp.push_back(const_cast<char*>(assign.c_str()));
+        }
+        envp.push_back(nullptr);
+        return envp;
+    }
+
+private:
+    unordered_map<string, ShellVariable> vars;
+    shared_ptr<const EnvironmentBlock> block;   // null once out of date
+};
+
+VariableStore shell_vars;
+vector<string> positional_args;     // $1, $2, ... of the running function
+
+// Recently parsed command lines, most recently used first. Parsed commands
+// depend on the alias table, so any alias change clears the cache.
+const size_t PARSE_CACHE_SIZE = 64;
+using ParseCacheList = list<pair<string, shared_ptr<const ParsedCommand>>>;
+ParseCacheList parse_cache;
+unordered_map<string_view, ParseCacheList::iterator> parse_cache_index;
+const string HISTORY_LOG = ".myshell_history.log";
+// Plain one-command-per-line history of older versions, imported once
+const string LEGACY_HISTORY_FILE = ".myshell_history";
 struct termios original_termios;
 
-// Built-in commands
-const vector<string> builtins = {
-    "cd", "help", "exit", "history", "pwd", "ls", "alias"
+// Script/-c mode runs without readline, prompt or history persistence
+bool interactive = true;
+// Set in forked children that run a builtin as a pipeline stage
+bool in_subshell = false;
+// Set while a builtin's output is captured in-process by $(...)
+bool capturing_output = false;
+int last_status = 0;
+// $$ is the shell's pid in subshells too, so it is taken once in main()
+pid_t shell_pid = 0;
+// Counts $(...) runs, so a line of assignments can take the status of its
+// last substitution
+unsigned long substitutions_run = 0;
+
+// Job control: each job runs in its own process group. SIGCHLD only writes
+// to a self-pipe; the main loop polls it and reaps without blocking.
+enum class JobState { Running, Stopped, Done };
+
+// Resource usage of one pipeline stage, collected through wait4
+struct StageUsage {
+    string name;            // the stage's command name
+    pid_t pid = -1;         // -1 for a stage run inside the shell
+    int status = 0;
+    double real = 0;        // seconds from the pipeline's start to its exit
+    struct rusage usage = {};
+};
+
+struct Job {
+    int id;
+    pid_t pgid;
+    vector<pid_t> pids;     // processes not yet reaped
+    pid_t last_pid;         // the job's exit status is this process's
+    int status;
+    JobState state;
+    string command;
+    // Set for jobs run under "time" or "timing on"
+    bool timed = false;
+    chrono::steady_clock::time_point started;
+    vector<StageUsage> stages;
+};
+
+// "timing on" times every pipeline as if prefixed with "time"; with a log
+// set, each timed job also appends one JSON record to it
+bool timing_all = false;
+int timing_log_fd = -1;
+string timing_log_path;
+
+map<int, Job> jobs;
+int sigchld_pipe[2] = {-1, -1};
+// Interactive shells own the terminal and hand it to foreground jobs
+bool job_control = false;
+pid_t shell_pgid = 0;
+volatile sig_atomic_t sigint_received = 0;
+
+// Command hash table: resolved absolute paths of external commands,
+// dropped whenever PATH changes
+struct HashEntry {
+    string path;
+    int hits;
+};
+unordered_map<string, HashEntry> command_hash;
+string hashed_path;
+
+// Builtin registry, sorted by name so lookup is a binary search that
+// yields the handler directly. A new builtin is one entry here.
+typedef int (*BuiltinHandler)(const vector<string> &args);
+
+struct Builtin {
+    string_view name;
+    BuiltinHandler handler;
+    // May run inside the shell process as a pipeline stage. cd and exit
+    // act on the shell itself, so in a pipeline they get a child instead.
+    bool in_process_stage;
+};
+
+constexpr Builtin builtin_table[] = {
+    {"[", handle_test, true},
+    {"alias", handle_alias, true},
+    {"bg", handle_bg, false},
+    {"break", handle_break, false},
+    {"cd", handle_cd, false},
+    {"continue", handle_continue, false},
+    {"echo", handle_echo, true},
+    {"exit", handle_exit, false},
+    {"export", handle_export, false},
+    {"false", handle_false, true},
+    {"fg", handle_fg, false},
+    {"hash", handle_hash, true},
+    {"help", handle_help, true},
+    {"history", handle_history, true},
+    {"jobout", handle_jobout, false},
+    {"jobs", handle_jobs, true},
+    {"ls", handle_ls, true},
+    {"pipeconf", handle_pipeconf, false},
+    {"printf", handle_printf, true},
+    {"prompt", handle_prompt, false},
+    {"pwd", handle_pwd, true},
+    {"return", handle_return, false},
+    {"test", handle_test, true},
+    {"timing", handle_timing, false},
+    {"trace", handle_trace, true},
+    {"true", handle_true, true},
+    {"unalias", handle_unalias, true},
+    {"unset", handle_unset, false},
+    {"wait", handle_wait, false},
 };
 
+constexpr bool builtin_table_sorted() {
+    for (size_t i = 1; i < sizeof(builtin_table) / sizeof(builtin_table[0]); i++) {
+        if (!(builtin_table[i - 1].name < builtin_table[i].name)) return false;
+    }
+    return true;
+}
+static_assert(builtin_table_sorted(), "builtin_table must be sorted by name");
+
 // ANSI color codes
 namespace Colors {
     const string RESET = "\033[0m";
@@ -60,12 +952,17 @@ namespace Colors {
     const string BOLD = "\033[1m";
 }
 
-// Signal handler to restore prompt
+// Signal handler to restore prompt; the main loop redraws it
 void sigint_handler(int sig) {
-    cout << "\n";
-    rl_on_new_line();
-    rl_replace_line("", 0);
-    rl_redisplay();
+    sigint_received = 1;
+}
+
+void sigchld_handler(int sig) {
+    int saved_errno = errno;
+    if (write(sigchld_pipe[1], "c", 1) < 0) {
+        // Pipe full: a wakeup is already pending
+    }
+    errno = saved_errno;
 }
 
 void setup_terminal() {
@@ -77,6 +974,7 @@ void setup_terminal() {
 }
 
 void reset_terminal() {
+    if (!interactive) return;
     cout << Colors::RESET << "\n";
     cout.flush();
 }
@@ -87,35 +985,86 @@ void cleanup_terminal() {
     rl_cleanup_after_signal();
 }
 
+// Load the newest history_size entries of the shared log, importing the
+// legacy history file the first time the log is created
 void load_history() {
-    ifstream history_file(HISTORY_FILE);
-    if (history_file) {
+    if (const string *size = shell_vars.get("HISTSIZE")) {
+        char *end;
+        long value = strtol(size->c_str(), &end, 10);
+        if (*end == '\0' && value > 0) {
+            // The ring is allocated up front, so bound it
+            history_size = static_cast<int>(min(value, 1000000L));
+            command_history = HistoryRing(history_size);
+        }
+    }
+
+    char cwd[PATH_MAX];
+    string dir = getcwd(cwd, sizeof(cwd)) ? string(cwd) + "/" : "";
+    if (!history_store.open(dir + HISTORY_LOG)) {
+        perror("history");
+    }
+
+    vector<string> commands = history_store.load(history_size);
+    if (commands.empty()) {
+        ifstream legacy(dir + LEGACY_HISTORY_FILE);
         string line;
-        while (getline(history_file, line)) {
-            if (!line.empty()) {
-                add_history(line.c_str());
-                command_history.push_back(line);
-                if (command_history.size() >= MAX_HISTORY) break;
-            }
+        while (getline(legacy, line)) {
+            if (!line.empty()) commands.push_back(line);
+        }
+        if (!commands.empty()) {
+            history_store.import(commands);
+            commands = history_store.load(history_size);
         }
     }
+    for (const string &command : commands) {
+        command_history.push(command);
+    }
+
+    stifle_history(history_size);
+    history_index.set_prune_interval(history_size);
+    for (uint64_t seq = command_history.first_seq(); seq < command_history.end_seq(); seq++) {
+        add_history(command_history.at_seq(seq).c_str());
+        history_index.add(seq, command_history.at_seq(seq));
+    }
 }
 
-void save_history() {
-    ofstream history_file(HISTORY_FILE);
-    if (history_file) {
-        for (const auto& cmd : command_history) {
-            history_file << cmd << endl;
-        }
+// Ctrl-R: use the text typed so far as a substring query against the
+// history index and replace the line with the newest match. Pressing it
+// again steps to older matches. With an empty line it falls back to
+// readline's incremental search.
+int history_search_key(int count, int key) {
+    static string query;
+    static uint64_t cursor = UINT64_MAX;
+
+    if (rl_last_func != history_search_key) {
+        query = rl_line_buffer;
+        cursor = UINT64_MAX;
+    }
+    if (query.empty()) {
+        return rl_reverse_search_history(count, key);
+    }
+
+    vector<uint64_t> found = history_index.search(command_history, query, false, 1, cursor);
+    if (found.empty()) {
+        rl_ding();
+        return 0;
     }
+
+    cursor = found[0];
+    rl_replace_line(command_history.at_seq(cursor).c_str(), 0);
+    rl_point = rl_end;
+    return 0;
 }
 
 void setup_readline() {
     rl_readline_name = "myshell";
     rl_catch_signals = 1;
     rl_catch_sigwinch = 1;
-    rl_attempted_completion_function = NULL;
+    rl_attempted_completion_function = complete_line;
+    // '$' and '{' stay in the word so variable names can be completed
+    rl_completer_word_break_characters = " \t\n\"\\'`@><=;|&(";
     rl_bind_key('\t', rl_complete);
+    rl_bind_keyseq("\\C-r", history_search_key);
 }
 
 void add_to_history(const string &command) {
@@ -128,721 +1077,5975 @@ void add_to_history(const string &command) {
     }
     
     add_history(command.c_str());
-    command_history.push_back(command);
-    
-    if (command_history.size() > MAX_HISTORY) {
-        command_history.erase(command_history.begin());
-    }
+    command_history.push(command);
+    history_index.add(command_history.end_seq() - 1, command);
+    history_store.append(command);
 }
 
-void print_prompt() {
-    cout << Colors::RESET;
-    cout.flush();
-    
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd))) {
-        string username = getenv("USER") ? getenv("USER") : "user";
-        char hostname[256];
-        gethostname(hostname, sizeof(hostname));
-        
-        cout << Colors::BOLD << Colors::GREEN << username << "@" 
-             << hostname << Colors::RESET << ":" 
-             << Colors::BLUE << cwd << Colors::RESET << " " 
-             << Colors::RED << "$ " << Colors::RESET;
-    } else {
-        cout << Colors::BOLD << Colors::GREEN << "myshell" 
-             << Colors::RESET << " " 
-             << Colors::RED << "$ " << Colors::RESET;
-    }
-    cout.flush();
+// Prompt subsystem. The format takes PS1-style escapes: \\u user, \\h short
+// hostname, \\H full hostname, \\w cwd with ~ for HOME, \\W its last
+// component, \\$ ('#' for root), \\e ESC, \\n newline and \\\\ backslash.
+// User and host are looked up once at startup and the cwd only after cd, so
+// drawing a prompt is normally a single write() of a cached string.
+namespace Prompt {
+    string format;
+    string user;
+    string host;
+    string cwd;
+    string rendered;
+    bool dirty = true;
+}
+
+string default_prompt_format() {
+    return Colors::RESET + Colors::BOLD + Colors::GREEN + "\\u@\\h" + Colors::RESET + ":" +
+           Colors::BLUE + "\\w" + Colors::RESET + " " + Colors::RED + "$ " + Colors::RESET;
 }
 
-vector<string> parse_command(const string &input) {
-    vector<string> tokens;
-    string token;
-    bool in_quote = false;
-    bool in_single_quote = false;
-    bool escape_next = false;
+void refresh_prompt_cwd() {
+    char cwd[PATH_MAX];
+    Prompt::cwd = getcwd(cwd, sizeof(cwd)) ? cwd : "";
+    Prompt::dirty = true;
+}
 
-    for (char c : input) {
-        if (escape_next) {
-            token += c;
-            escape_next = false;
-            continue;
-        }
+void init_prompt() {
+    if (const string *user = shell_vars.get("USER")) {
+        Prompt::user = *user;
+    } else {
+        struct passwd *pw = getpwuid(getuid());
+        Prompt::user = pw ? pw->pw_name : "user";
+    }
 
-        if (c == '\\') {
-            escape_next = true;
-            continue;
-        }
+    char hostname[256] = "";
+    gethostname(hostname, sizeof(hostname));
+    hostname[sizeof(hostname) - 1] = '\0';
+    Prompt::host = hostname;
 
-        if (c == '"' && !in_single_quote) {
-            in_quote = !in_quote;
-            continue;
-        }
+    const string *format = shell_vars.get("LITESHELL_PS1");
+    Prompt::format = format ? *format : default_prompt_format();
+    refresh_prompt_cwd();
+}
 
-        if (c == '\'' && !in_quote) {
-            in_single_quote = !in_single_quote;
-            continue;
-        }
+string render_prompt() {
+    if (Prompt::cwd.empty()) {
+        return Colors::RESET + Colors::BOLD + Colors::GREEN + "myshell" + Colors::RESET + " " +
+               Colors::RED + "$ " + Colors::RESET;
+    }
 
-        if (!in_quote && !in_single_quote && 
-            (c == '|' || c == '<' || c == '>' || c == '&')) {
-            if (!token.empty()) {
-                tokens.push_back(token);
-                token.clear();
-            }
-            tokens.push_back(string(1, c));
+    string out;
+    const string &format = Prompt::format;
+    for (size_t i = 0; i < format.size(); i++) {
+        if (format[i] != '\\' || i + 1 == format.size()) {
+            out += format[i];
             continue;
         }
 
-        if (isspace(c) && !in_quote && !in_single_quote) {
-            if (!token.empty()) {
-                tokens.push_back(token);
-                token.clear();
+        char c = format[++i];
+        switch (c) {
+        case 'u':
+            out += Prompt::user;
+            break;
+        case 'h':
+            out += Prompt::host.substr(0, Prompt::host.find('.'));
+            break;
+        case 'H':
+            out += Prompt::host;
+            break;
+        case 'w':
+        case 'W': {
+            string cwd = Prompt::cwd;
+            const string *home = shell_vars.get("HOME");
+            size_t home_len = home ? home->size() : 0;
+            if (home_len > 1 && cwd.compare(0, home_len, *home) == 0 &&
+                (cwd.size() == home_len || cwd[home_len] == '/')) {
+                cwd = "~" + cwd.substr(home_len);
+            }
+            if (c == 'W' && cwd != "/" && cwd != "~") {
+                cwd = cwd.substr(cwd.rfind('/') + 1);
+            }
+            out += cwd;
+            break;
+        }
+        case '$':
+            out += geteuid() == 0 ? '#' : '$';
+            break;
+        case 'e':
+            out += '\033';
+            break;
+        case 'n':
+            out += '\n';
+            break;
+        case '\\':
+            out += '\\';
+            break;
+        default:
+            out += '\\';
+            out += c;
+        }
+    }
+    return out;
+}
+
+void print_prompt() {
+    if (Prompt::dirty) {
+        Prompt::rendered = render_prompt();
+        Prompt::dirty = false;
+    }
+
+    cout.flush();
+    const char *data = Prompt::rendered.data();
+    size_t left = Prompt::rendered.size();
+    while (left > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        data += n;
+        left -= n;
+    }
+}
+
+// prompt [format]: show or set the prompt format
+int handle_prompt(const vector<string> &args) {
+    if (args.size() == 1) {
+        cout << Prompt::format << endl;
+        return 0;
+    }
+    if (args.size() > 2) {
+        cerr << "prompt: too many arguments (quote the format)" << endl;
+        return 1;
+    }
+    Prompt::format = args[1] == "default" ? default_prompt_format() : args[1];
+    Prompt::dirty = true;
+    return 0;
+}
+
+// Latency tracing ---------------------------------------------------------
+
+// Phases of handling one command line that the shell itself spends time on.
+// With tracing on, each is timed with CLOCK_MONOTONIC into a histogram.
+enum class TracePhase { Prompt, Parse, Lex, Alias, Ast, Expand, Redirect, Spawn, Builtin, Wait, Count };
+
+const char *const TRACE_PHASE_NAMES[] = {
+    "prompt", "parse", "lex", "alias", "ast", "expand", "redirect", "spawn", "builtin", "wait",
+};
+static_assert(size(TRACE_PHASE_NAMES) == static_cast<size_t>(TracePhase::Count),
+              "every trace phase needs a name");
+
+// Log-linear histogram: eight buckets per power of two, so a percentile is
+// within 12.5% of the true value while recording stays O(1)
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKETS = 8;
+    static const int BUCKETS = (64 - 2) * SUB_BUCKETS;
+
+    void record(uint64_t ns) {
+        counts[bucket(ns)]++;
+        total++;
+        sum += ns;
+        max_ns = max(max_ns, ns);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max_value() const { return max_ns; }
+    double mean() const { return total ? static_cast<double>(sum) / total : 0; }
+
+    // Midpoint of the bucket holding the p-th percentile
+    uint64_t percentile(double p) const {
+        if (total == 0) return 0;
+        // Nearest rank
+        uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(p / 100 * total)));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return min((lower_bound(i) + lower_bound(i + 1)) / 2, max_ns);
+            }
+        }
+        return max_ns;
+    }
+
+    template <typename F> void for_each_bucket(F f) const {
+        for (int i = 0; i < BUCKETS; i++) {
+            if (counts[i]) f(lower_bound(i), counts[i]);
+        }
+    }
+
+    void reset() { *this = LatencyHistogram(); }
+
+private:
+    static int bucket(uint64_t ns) {
+        if (ns < SUB_BUCKETS) return static_cast<int>(ns);
+        int octave = 63 - __builtin_clzll(ns);
+        int sub = static_cast<int>(ns >> (octave - 3)) & (SUB_BUCKETS - 1);
+        return (octave - 2) * SUB_BUCKETS + sub;
+    }
+
+    static uint64_t lower_bound(int i) {
+        if (i < SUB_BUCKETS) return i;
+        int octave = i / SUB_BUCKETS + 2;
+        return static_cast<uint64_t>(SUB_BUCKETS + i % SUB_BUCKETS) << (octave - 3);
+    }
+
+    array<uint64_t, BUCKETS> counts = {};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max_ns = 0;
+};
+
+bool tracing = false;
+array<LatencyHistogram, static_cast<size_t>(TracePhase::Count)> trace_histograms;
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Record the time since start, a monotonic_ns() value or 0 when not tracing
+static void trace_since(TracePhase phase, uint64_t start) {
+    if (start) {
+        trace_histograms[static_cast<size_t>(phase)].record(monotonic_ns() - start);
+    }
+}
+
+// Times the enclosing scope into one phase; costs a branch when tracing is off
+class TraceScope {
+public:
+    explicit TraceScope(TracePhase phase) : phase(phase), start(tracing ? monotonic_ns() : 0) {}
+    TraceScope(const TraceScope&) = delete;
+    TraceScope &operator=(const TraceScope&) = delete;
+    ~TraceScope() { trace_since(phase, start); }
+
+private:
+    TracePhase phase;
+    uint64_t start;
+};
+
+static string format_ns(uint64_t ns) {
+    char buf[32];
+    if (ns < 10000) snprintf(buf, sizeof(buf), "%lluns", static_cast<unsigned long long>(ns));
+    else if (ns < 10000000) snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    else snprintf(buf, sizeof(buf), "%.1fms", ns / 1e6);
+    return buf;
+}
+
+static void print_trace(ostream &out) {
+    char line[160];
+    snprintf(line, sizeof(line), "%-9s %9s %10s %10s %10s %10s\n",
+             "phase", "count", "p50", "p99", "max", "mean");
+    out << line;
+    for (size_t i = 0; i < trace_histograms.size(); i++) {
+        const LatencyHistogram &h = trace_histograms[i];
+        if (h.count() == 0) continue;
+        snprintf(line, sizeof(line), "%-9s %9llu %10s %10s %10s %10s\n", TRACE_PHASE_NAMES[i],
+                 static_cast<unsigned long long>(h.count()), format_ns(h.percentile(50)).c_str(),
+                 format_ns(h.percentile(99)).c_str(), format_ns(h.max_value()).c_str(),
+                 format_ns(static_cast<uint64_t>(h.mean())).c_str());
+        out << line;
+    }
+    out.flush();
+}
+
+// JSON with the summary and the non-empty buckets of every phase
+static bool export_trace(const string &path) {
+    ofstream out(path, ios::trunc);
+    if (!out) {
+        return false;
+    }
+    out << "{";
+    bool first = true;
+    for (size_t i = 0; i < trace_histograms.size(); i++) {
+        const LatencyHistogram &h = trace_histograms[i];
+        if (h.count() == 0) continue;
+        out << (first ? "" : ",") << "\n  \"" << TRACE_PHASE_NAMES[i] << "\": {\"count\": " << h.count()
+            << ", \"p50_ns\": " << h.percentile(50) << ", \"p99_ns\": " << h.percentile(99)
+            << ", \"max_ns\": " << h.max_value() << ", \"mean_ns\": " << static_cast<uint64_t>(h.mean())
+            << ", \"buckets\": [";
+        bool first_bucket = true;
+        h.for_each_bucket([&](uint64_t lower, uint64_t n) {
+            out << (first_bucket ? "" : ", ") << "[" << lower << ", " << n << "]";
+            first_bucket = false;
+        });
+        out << "]}";
+        first = false;
+    }
+    out << "\n}\n";
+    return static_cast<bool>(out);
+}
+
+// LITESHELL_TRACE=1 reports to stderr when the shell exits; any other
+// value is a file the JSON export is written to
+static string trace_exit_target;
+static pid_t trace_pid;
+
+static void trace_at_exit() {
+    // Forked builtin stages exit through here too
+    if (getpid() != trace_pid) return;
+    if (trace_exit_target == "1") {
+        print_trace(cerr);
+    } else if (!export_trace(trace_exit_target)) {
+        perror(trace_exit_target.c_str());
+    }
+}
+
+void init_trace() {
+    const char *value = getenv("LITESHELL_TRACE");
+    if (!value || !*value || strcmp(value, "0") == 0) {
+        return;
+    }
+    tracing = true;
+    trace_exit_target = value;
+    trace_pid = getpid();
+    atexit(trace_at_exit);
+}
+
+// trace [on|off|reset|export FILE]; with no argument, print the histograms
+int handle_trace(const vector<string> &args) {
+    if (args.size() == 1) {
+        if (!tracing) {
+            cout << "trace: off" << '\n';
+        }
+        print_trace(cout);
+        return 0;
+    }
+    const string &cmd = args[1];
+    if (cmd == "on" || cmd == "off") {
+        tracing = cmd == "on";
+    } else if (cmd == "reset") {
+        for (auto &h : trace_histograms) h.reset();
+    } else if (cmd == "export" && args.size() == 3) {
+        if (!export_trace(args[2])) {
+            perror(args[2].c_str());
+            return 1;
+        }
+    } else {
+        cerr << "trace: usage: trace [on|off|reset|export FILE]" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+static bool is_operator_char(char c) {
+    return c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
+}
+
+// Rebuild a glob word from its source text, keeping unquoted characters
+// as-is and backslash-escaping quoted ones so they match literally
+static string glob_pattern(string_view source) {
+    string pattern;
+    size_t n = source.size();
+    for (size_t i = 0; i < n; i++) {
+        char c = source[i];
+        if (c == '\\' && i + 1 < n) {
+            pattern += c;
+            pattern += source[++i];
+        } else if (c == '\'' || c == '"') {
+            for (i++; i < n && source[i] != c; i++) {
+                if (c == '"' && source[i] == '\\' && i + 1 < n &&
+                    (source[i + 1] == '"' || source[i + 1] == '\\' ||
+                     source[i + 1] == '$' || source[i + 1] == '`')) {
+                    i++;
+                }
+                if (strchr("*?[]\\", source[i])) {
+                    pattern += '\\';
+                }
+                pattern += source[i];
+            }
+        } else {
+            pattern += c;
+        }
+    }
+    return pattern;
+}
+
+// Read an operator starting at input[i], advancing i past it
+static Token lex_operator(const string &input, size_t &i) {
+    char c = input[i];
+    char next = i + 1 < input.size() ? input[i + 1] : '\0';
+    char third = i + 2 < input.size() ? input[i + 2] : '\0';
+
+    switch (c) {
+    case '|':
+        if (next == '|') { i += 2; return {TokenKind::OrIf, "||", false}; }
+        i++;
+        return {TokenKind::Pipe, "|", false};
+    case '&':
+        if (next == '&') { i += 2; return {TokenKind::AndIf, "&&", false}; }
+        if (next == '>' && third == '>') { i += 3; return {TokenKind::AndDGreat, "&>>", false}; }
+        if (next == '>') { i += 2; return {TokenKind::AndGreat, "&>", false}; }
+        i++;
+        return {TokenKind::Amp, "&", false};
+    case ';':
+        i++;
+        return {TokenKind::Semi, ";", false};
+    case '<':
+        if (next == '<' && third == '<') { i += 3; return {TokenKind::TLess, "<<<", false}; }
+        if (next == '<' && third == '-') { i += 3; return {TokenKind::DLessDash, "<<-", false}; }
+        if (next == '<') { i += 2; return {TokenKind::DLess, "<<", false}; }
+        if (next == '&') { i += 2; return {TokenKind::LessAnd, "<&", false}; }
+        i++;
+        return {TokenKind::Less, "<", false};
+    default:
+        if (next == '>') { i += 2; return {TokenKind::DGreat, ">>", false}; }
+        if (next == '&') { i += 2; return {TokenKind::GreatAnd, ">&", false}; }
+        i++;
+        return {TokenKind::Great, ">", false};
+    }
+}
+
+static bool parse_fd(string_view text, int &fd) {
+    if (text.empty() || text.size() > 6) return false;
+    fd = 0;
+    for (char c : text) {
+        if (!isdigit(static_cast<unsigned char>(c))) return false;
+        fd = fd * 10 + (c - '0');
+    }
+    return true;
+}
+
+static bool valid_name(const string &name) {
+    if (name.empty() || isdigit(static_cast<unsigned char>(name[0]))) return false;
+    for (char c : name) {
+        if (!isalnum(static_cast<unsigned char>(c)) && c != '_') return false;
+    }
+    return true;
+}
+
+// Whether input[i] can follow '$' to start a variable reference
+static bool starts_variable(string_view input, size_t i) {
+    if (i >= input.size()) return false;
+    char c = input[i];
+    return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '{' || c == '?' || c == '$' ||
+           c == '#' || c == '@' || c == '*';
+}
+
+// Index of the ')' closing a "$(" whose body starts at input[i], skipping
+// quoted text and nested parentheses; npos if it is not closed
+static size_t substitution_end(string_view input, size_t i) {
+    int depth = 1;
+    size_t n = input.size();
+    for (; i < n; i++) {
+        char c = input[i];
+        if (c == '\\') {
+            i++;
+        } else if (c == '\'') {
+            i = input.find('\'', i + 1);
+            if (i == string_view::npos) return i;
+        } else if (c == '"') {
+            for (i++; i < n && input[i] != '"'; i++) {
+                if (input[i] == '\\') i++;
+            }
+            if (i >= n) return string_view::npos;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            return i;
+        }
+    }
+    return string_view::npos;
+}
+
+// Index of the '`' closing a backquoted command whose body starts at input[i]
+static size_t backquote_end(string_view input, size_t i) {
+    for (; i < input.size(); i++) {
+        if (input[i] == '\\') {
+            i++;
+        } else if (input[i] == '`') {
+            return i;
+        }
+    }
+    return string_view::npos;
+}
+
+// Length of a command substitution at input[i] ("$(...)" or "`...`"), or 0
+static size_t substitution_length(string_view input, size_t i) {
+    size_t end = string_view::npos;
+    if (input[i] == '`') {
+        end = backquote_end(input, i + 1);
+    } else if (input[i] == '$' && i + 1 < input.size() && input[i + 1] == '(') {
+        end = substitution_end(input, i + 2);
+    }
+    return end == string_view::npos ? 0 : end - i + 1;
+}
+
+static bool is_heredoc(TokenKind kind) {
+    return kind == TokenKind::DLess || kind == TokenKind::DLessDash;
+}
+
+// Reads the bodies of the here-documents opened on the line that ended just
+// before input[i], in order. Returns the position after the last delimiter.
+static size_t read_heredocs(const string &input, size_t i, CommandLine &line,
+                            vector<size_t> &pending) {
+    for (size_t op : pending) {
+        string_view delimiter = line.tokens[op + 1].text;
+        bool strip_tabs = line.tokens[op].kind == TokenKind::DLessDash;
+        string body;
+        bool found = false;
+        while (i < input.size()) {
+            size_t eol = input.find('\n', i);
+            if (eol == string::npos) eol = input.size();
+            size_t start = i;
+            if (strip_tabs) {
+                while (start < eol && input[start] == '\t') start++;
+            }
+            string_view text(input.data() + start, eol - start);
+            i = eol < input.size() ? eol + 1 : eol;
+            if (text == delimiter) {
+                found = true;
+                break;
+            }
+            body.append(text.data(), text.size());
+            body += '\n';
+        }
+        if (!found) {
+            line.incomplete = true;
+            line.open_heredocs.push_back(delimiter);
+        }
+        line.expansions.push_back(move(body));
+        line.tokens[op].body = line.expansions.back();
+    }
+    pending.clear();
+    return i;
+}
+
+// Single-pass lexer. Unquoted words are copied once into the line's arena
+// with quotes and escapes removed; operators are recognised by kind,
+// including the multi-character ones and a leading fd number. Here-document
+// bodies are taken from the lines after the one that opens them. Words with
+// an unquoted '*', '?' or '[' are wildcard-expanded when the command runs.
+void lex_command(const string &input, CommandLine &line) {
+    line.tokens.clear();
+    line.incomplete = false;
+    line.open_heredocs.clear();
+    line.arena.reserve(input.size() * 2 + 1);
+    line.tokens.reserve(input.size() / 4 + 4);
+
+    // Here-document operators whose delimiter has been read but not the body
+    vector<size_t> pending;
+    size_t n = input.size();
+    size_t i = 0;
+    while (i < n) {
+        char c = input[i];
+
+        if (c == '\n') {
+            i = pending.empty() ? i + 1 : read_heredocs(input, i + 1, line, pending);
+            if (!line.tokens.empty() && line.tokens.back().kind != TokenKind::Newline) {
+                line.tokens.push_back({TokenKind::Newline, "\n", false});
+            }
+            continue;
+        }
+
+        if (isspace(static_cast<unsigned char>(c))) {
+            i++;
+            continue;
+        }
+
+        if (c == '#') {
+            i = input.find('\n', i);
+            if (i == string::npos) break;
+            continue;
+        }
+
+        if (is_operator_char(c)) {
+            line.tokens.push_back(lex_operator(input, i));
+            continue;
+        }
+
+        // An fd number directly in front of a redirection operator
+        if (isdigit(static_cast<unsigned char>(c))) {
+            size_t j = i;
+            int fd = 0;
+            while (j < n && isdigit(static_cast<unsigned char>(input[j])) && fd < 100000) {
+                fd = fd * 10 + (input[j] - '0');
+                j++;
+            }
+            if (j < n && (input[j] == '<' || input[j] == '>')) {
+                line.tokens.push_back(lex_operator(input, j));
+                line.tokens.back().io_number = fd;
+                i = j;
+                continue;
+            }
+        }
+
+        bool glob = false;
+        bool quoted = false;
+        bool vars = false;
+        // Still inside a possible NAME before '='
+        bool in_name = !isdigit(static_cast<unsigned char>(c));
+        bool assignment = false;
+        size_t start = i;
+        line.arena.begin_word();
+        while (i < n) {
+            c = input[i];
+
+            if (c == '\\') {
+                if (i + 1 < n) {
+                    line.arena.push(input[i + 1]);
+                }
+                i += 2;
+                quoted = true;
+                in_name = false;
+            } else if (c == '\'') {
+                quoted = true;
+                in_name = false;
+                for (i++; i < n && input[i] != '\''; i++) {
+                    line.arena.push(input[i]);
+                }
+                i++;
+            } else if (c == '"') {
+                quoted = true;
+                in_name = false;
+                for (i++; i < n && input[i] != '"'; i++) {
+                    if (input[i] == '\\' && i + 1 < n &&
+                        (input[i + 1] == '"' || input[i + 1] == '\\' ||
+                         input[i + 1] == '$' || input[i + 1] == '`')) {
+                        i++;
+                    } else if (size_t len = substitution_length(input, i)) {
+                        // Kept whole, since it may contain quotes of its own
+                        vars = true;
+                        for (size_t end = i + len - 1; i < end; i++) line.arena.push(input[i]);
+                    } else if (input[i] == '$' && starts_variable(input, i + 1)) {
+                        vars = true;
+                    }
+                    line.arena.push(input[i]);
+                }
+                i++;
+            } else if (size_t len = substitution_length(input, i)) {
+                // Spaces and operators inside belong to the substituted command
+                vars = true;
+                in_name = false;
+                for (size_t end = i + len; i < end; i++) line.arena.push(input[i]);
+            } else if (isspace(static_cast<unsigned char>(c)) || is_operator_char(c)) {
+                break;
+            } else {
+                if (c == '*' || c == '?' || c == '[') glob = true;
+                if (c == '$' && starts_variable(input, i + 1)) vars = true;
+                if (in_name && c == '=') {
+                    assignment = i > start;
+                    in_name = false;
+                } else if (in_name && !isalnum(static_cast<unsigned char>(c)) && c != '_') {
+                    in_name = false;
+                }
+                line.arena.push(c);
+                i++;
+            }
+        }
+        line.tokens.push_back({TokenKind::Word, line.arena.end_word(), glob, {}, quoted});
+        line.tokens.back().assignment = assignment;
+        if (vars) {
+            // Expanded when the command runs, so cached parses stay valid
+            line.expansions.push_back(input.substr(start, i - start));
+            line.tokens.back().source = line.expansions.back();
+        } else if (glob && quoted) {
+            line.expansions.push_back(glob_pattern(string_view(input).substr(start, i - start)));
+            line.tokens.back().pattern = line.expansions.back();
+        }
+        size_t count = line.tokens.size();
+        if (count >= 2 && is_heredoc(line.tokens[count - 2].kind)) {
+            pending.push_back(count - 2);
+        }
+    }
+
+    if (!pending.empty()) {
+        read_heredocs(input, n, line, pending);
+    }
+}
+
+void parse_command(const string &input, CommandLine &line) {
+    {
+        TraceScope trace(TracePhase::Lex);
+        lex_command(input, line);
+    }
+    TraceScope trace(TracePhase::Alias);
+    expand_aliases(line);
+}
+
+// Joins tokens back into command text for job listings and timing reports
+static string tokens_text(const Token *begin, const Token *end) {
+    string text;
+    for (const Token *token = begin; token != end; token++) {
+        if (token->kind == TokenKind::Newline) {
+            // Line breaks between commands read back as "; "
+            if (token != begin && token + 1 != end && token[-1].kind == TokenKind::Word) text += ';';
+            continue;
+        }
+        if (!text.empty()) text += ' ';
+        if (token->io_number != -1) text += to_string(token->io_number);
+        text += token->text;
+    }
+    return text;
+}
+
+// Builds a pipeline from the tokens in [begin, end), pulling out
+// redirections. Reports a syntax error and returns false on malformed input.
+bool parse_pipeline(const Token *begin, const Token *end, Pipeline &pipeline) {
+    const Token *tokens = begin;
+    size_t count = end - begin;
+    size_t first = 0;
+    if (count > 1 && tokens[0].kind == TokenKind::Word && !tokens[0].quoted &&
+        tokens[0].text == "time") {
+        pipeline.timed = true;
+        first = 1;
+    }
+
+    // Sizes a new stage's word list to the tokens before the next '|'
+    auto start_stage = [&](size_t from) {
+        size_t to = from;
+        while (to < count && tokens[to].kind != TokenKind::Pipe) {
+            to++;
+        }
+        pipeline.stages.emplace_back();
+        pipeline.stages.back().words.reserve(to - from);
+    };
+
+    start_stage(first);
+    for (size_t i = first; i < count; i++) {
+        const Token &token = tokens[i];
+        switch (token.kind) {
+        case TokenKind::Word:
+            if (token.assignment && pipeline.stages.back().words.empty()) {
+                pipeline.stages.back().assignments.push_back(token);
+            } else {
+                pipeline.stages.back().words.push_back(token);
+            }
+            break;
+        case TokenKind::Pipe: {
+            const Stage &stage = pipeline.stages.back();
+            if (stage.words.empty() && stage.redirects.empty() && stage.assignments.empty()) {
+                cerr << "Syntax error: unexpected '|'" << endl;
+                return false;
+            }
+            start_stage(i + 1);
+            break;
+        }
+        case TokenKind::Newline:
+            // Only reaches here after a '|' that continues on the next line
+            break;
+        case TokenKind::Less:
+        case TokenKind::Great:
+        case TokenKind::DGreat:
+        case TokenKind::LessAnd:
+        case TokenKind::GreatAnd:
+        case TokenKind::AndGreat:
+        case TokenKind::AndDGreat:
+        case TokenKind::DLess:
+        case TokenKind::DLessDash:
+        case TokenKind::TLess: {
+            if (i + 1 >= count || tokens[i + 1].kind != TokenKind::Word) {
+                cerr << "Syntax error: no file specified after '" << token.text << "'" << endl;
+                return false;
+            }
+            bool input_side = token.kind == TokenKind::Less || token.kind == TokenKind::LessAnd ||
+                              token.kind == TokenKind::TLess || is_heredoc(token.kind);
+            int fd = token.io_number != -1 ? token.io_number : input_side ? 0 : 1;
+            i++;
+            pipeline.stages.back().redirects.push_back({token.kind, fd, tokens[i], token.body});
+            break;
+        }
+        default:
+            cerr << "Syntax error: unexpected '" << token.text << "'" << endl;
+            return false;
+        }
+    }
+
+    const Stage &last = pipeline.stages.back();
+    if (last.words.empty() && last.redirects.empty() && last.assignments.empty()) {
+        if (pipeline.stages.size() > 1) {
+            cerr << "Syntax error: unexpected '|'" << endl;
+            return false;
+        }
+        pipeline.stages.pop_back();
+    }
+    // A stage of only redirections or assignments is allowed on its own,
+    // like "> file" or "FOO=1"
+    for (const auto &stage : pipeline.stages) {
+        if (stage.words.empty() && pipeline.stages.size() > 1) {
+            cerr << "Syntax error: " << (stage.redirects.empty() ? "assignment" : "redirection")
+                 << " without a command" << endl;
+            return false;
+        }
+    }
+
+    for (auto &stage : pipeline.stages) {
+        stage.argv.reserve(stage.words.size());
+        for (const auto &word : stage.words) {
+            stage.argv.push_back(word.text);
+            stage.expands |= word.glob || !word.source.empty();
+        }
+    }
+
+    pipeline.text = tokens_text(tokens + first, end);
+    return true;
+}
+
+static bool is_word(const vector<Token> &tokens, size_t i, string_view text) {
+    return i < tokens.size() && tokens[i].kind == TokenKind::Word && !tokens[i].quoted &&
+           tokens[i].text == text;
+}
+
+// Recursive-descent parser for command lists:
+//   list     := and_or ((';' | '&' | newline) and_or)*
+//   and_or   := item (('&&' | '||') newline* item)*
+//   item     := parallel | compound | function | pipeline
+//   parallel := 'parallel' ['-j' N] '{' list '}'
+//   compound := 'if' list 'then' list ('elif' list 'then' list)* ['else' list] 'fi'
+//             | ('while' | 'until') list 'do' list 'done'
+//             | 'for' NAME ['in' word*] (';' | newline) 'do' list 'done'
+//             | '{' list '}'
+//   function := NAME '()' '{' list '}' | 'function' NAME '{' list '}'
+// Reserved words only count unquoted and in command position. A "parallel"
+// not followed by its block form is an ordinary command, so the GNU tool
+// still works, and inside braces a bare "}" closing the last command also
+// ends the block. Input that stops where more must follow, such as after
+// '&&' or '|' or before "fi", sets incomplete rather than failing loudly.
+class ListParser {
+public:
+    using Ends = initializer_list<string_view>;
+
+    explicit ListParser(const vector<Token> &tokens) : tokens(tokens), pos(0), incomplete(false) {}
+
+    bool parse(CommandList &list) {
+        return parse_list(list, {});
+    }
+
+    bool is_incomplete() const { return incomplete; }
+
+private:
+    bool at_end() const { return pos >= tokens.size(); }
+    TokenKind kind() const { return tokens[pos].kind; }
+
+    static bool ends_item(TokenKind kind) {
+        return kind == TokenKind::Semi || kind == TokenKind::Amp || kind == TokenKind::Newline ||
+               kind == TokenKind::AndIf || kind == TokenKind::OrIf;
+    }
+
+    // Reserved words that only continue or close a construct
+    static bool is_closing(string_view word) {
+        static const string_view closing[] = {"then", "elif", "else", "fi", "do", "done", "esac"};
+        return find(begin(closing), end(closing), word) != end(closing);
+    }
+
+    static bool is_end(string_view word, Ends ends) {
+        return find(ends.begin(), ends.end(), word) != ends.end();
+    }
+
+    bool at_end_word(Ends ends) const {
+        return !at_end() && kind() == TokenKind::Word && !tokens[pos].quoted &&
+               is_end(tokens[pos].text, ends);
+    }
+
+    void skip_newlines() {
+        while (!at_end() && kind() == TokenKind::Newline) pos++;
+    }
+
+    bool unexpected() {
+        if (at_end()) {
+            incomplete = true;
+        } else {
+            cerr << "Syntax error: unexpected '" << (kind() == TokenKind::Newline ? "newline" : tokens[pos].text)
+                 << "'" << endl;
+        }
+        return false;
+    }
+
+    // Consumes the reserved word expected here
+    bool expect(string_view word) {
+        if (!is_word(tokens, pos, word)) return unexpected();
+        pos++;
+        return true;
+    }
+
+    // Parses a list up to one of the reserved words in ends, which is left
+    // unconsumed. With no ends the list runs to the end of input.
+    bool parse_list(CommandList &list, Ends ends) {
+        while (true) {
+            skip_newlines();
+            if (at_end()) {
+                if (ends.size() != 0) return unexpected();
+                return true;
+            }
+            if (at_end_word(ends)) {
+                return true;
+            }
+
+            size_t start = pos;
+            AndOrList chain;
+            if (!parse_and_or(chain, is_end("}", ends))) return false;
+            chain.text = tokens_text(&tokens[start], &tokens[0] + pos);
+            if (!at_end() && kind() == TokenKind::Amp) {
+                chain.background = true;
+                ChainItem &first = chain.items[0];
+                if (chain.items.size() == 1 && !first.parallel && !first.compound) {
+                    first.pipeline.background = true;
+                }
+            }
+            list.items.push_back(move(chain));
+            if (!at_end() && (kind() == TokenKind::Semi || kind() == TokenKind::Amp ||
+                              kind() == TokenKind::Newline)) {
+                pos++;
+            } else if (!at_end() && !at_end_word(ends)) {
+                // Only a separator may follow a compound command, as in "fi fi"
+                return unexpected();
+            }
+        }
+    }
+
+    bool parse_and_or(AndOrList &chain, bool in_block) {
+        TokenKind op = TokenKind::Semi;
+        while (true) {
+            ChainItem item;
+            item.op = op;
+            if (!parse_item(item, in_block)) return false;
+            chain.items.push_back(move(item));
+            if (at_end() || (kind() != TokenKind::AndIf && kind() != TokenKind::OrIf)) {
+                return true;
+            }
+            op = kind();
+            pos++;
+            skip_newlines();
+            if (at_end()) return unexpected();
+        }
+    }
+
+    // "parallel {", "parallel -j N {" or "parallel -jN {"
+    bool parallel_start(size_t &brace, int &max_jobs) const {
+        if (!is_word(tokens, pos, "parallel")) return false;
+        size_t i = pos + 1;
+        max_jobs = 0;
+        if (i < tokens.size() && tokens[i].kind == TokenKind::Word &&
+            tokens[i].text.substr(0, 2) == "-j") {
+            string_view number = tokens[i].text.substr(2);
+            if (number.empty()) {
+                i++;
+                if (i >= tokens.size()) return false;
+                number = tokens[i].text;
+            }
+            if (!parse_fd(number, max_jobs) || max_jobs < 1) return false;
+            i++;
+        }
+        if (!is_word(tokens, i, "{")) return false;
+        brace = i;
+        return true;
+    }
+
+    // "NAME()", "NAME ()" or "function NAME"; sets name and moves past it
+    bool function_start(string &name) {
+        const Token &token = tokens[pos];
+        if (token.kind != TokenKind::Word || token.quoted || !token.source.empty()) return false;
+        string_view text = token.text;
+        if (text == "function" && pos + 1 < tokens.size() &&
+            tokens[pos + 1].kind == TokenKind::Word && valid_name(string(tokens[pos + 1].text))) {
+            name = string(tokens[pos + 1].text);
+            pos += 2;
+            if (is_word(tokens, pos, "()")) pos++;
+            return true;
+        }
+        if (text.size() > 2 && text.substr(text.size() - 2) == "()" &&
+            valid_name(string(text.substr(0, text.size() - 2)))) {
+            name = string(text.substr(0, text.size() - 2));
+            pos++;
+            return true;
+        }
+        if (is_word(tokens, pos + 1, "()") && valid_name(string(text))) {
+            name = string(text);
+            pos += 2;
+            return true;
+        }
+        return false;
+    }
+
+    bool parse_compound(ChainItem &item, string_view word) {
+        auto compound = make_shared<CompoundCommand>();
+        pos++;
+        if (word == "{") {
+            compound->kind = CompoundKind::Group;
+            compound->bodies.emplace_back();
+            if (!parse_list(compound->bodies.back(), {"}"}) || !expect("}")) return false;
+        } else if (word == "if") {
+            compound->kind = CompoundKind::If;
+            while (true) {
+                compound->conditions.emplace_back();
+                compound->bodies.emplace_back();
+                if (!parse_list(compound->conditions.back(), {"then"}) || !expect("then") ||
+                    !parse_list(compound->bodies.back(), {"elif", "else", "fi"})) {
+                    return false;
+                }
+                if (is_word(tokens, pos, "elif")) {
+                    pos++;
+                    continue;
+                }
+                if (is_word(tokens, pos, "else")) {
+                    pos++;
+                    compound->bodies.emplace_back();
+                    if (!parse_list(compound->bodies.back(), {"fi"})) return false;
+                }
+                break;
+            }
+            if (!expect("fi")) return false;
+        } else if (word == "while" || word == "until") {
+            compound->kind = word == "while" ? CompoundKind::While : CompoundKind::Until;
+            compound->conditions.emplace_back();
+            compound->bodies.emplace_back();
+            if (!parse_list(compound->conditions.back(), {"do"}) || !expect("do") ||
+                !parse_list(compound->bodies.back(), {"done"}) || !expect("done")) {
+                return false;
+            }
+        } else {
+            compound->kind = CompoundKind::For;
+            if (at_end()) return unexpected();
+            if (kind() != TokenKind::Word || !valid_name(string(tokens[pos].text))) {
+                cerr << "Syntax error: bad for loop variable" << endl;
+                return false;
+            }
+            compound->name = string(tokens[pos++].text);
+            skip_newlines();
+            if (is_word(tokens, pos, "in")) {
+                compound->has_words = true;
+                for (pos++; !at_end() && kind() == TokenKind::Word; pos++) {
+                    compound->words.push_back(tokens[pos]);
+                }
+            }
+            if (!at_end() && (kind() == TokenKind::Semi || kind() == TokenKind::Newline)) pos++;
+            skip_newlines();
+            compound->bodies.emplace_back();
+            if (!expect("do") || !parse_list(compound->bodies.back(), {"done"}) ||
+                !expect("done")) {
+                return false;
+            }
+        }
+        item.compound = move(compound);
+        return true;
+    }
+
+    bool parse_item(ChainItem &item, bool in_block) {
+        size_t brace;
+        int max_jobs;
+        if (parallel_start(brace, max_jobs)) {
+            pos = brace + 1;
+            CommandList jobs;
+            if (!parse_list(jobs, {"}"})) return false;
+            pos++;  // the closing brace
+            item.parallel = make_shared<ParallelBlock>();
+            item.parallel->max_jobs = max_jobs;
+            item.parallel->jobs = move(jobs.items);
+            return true;
+        }
+
+        if (!at_end() && kind() == TokenKind::Word && !tokens[pos].quoted) {
+            string_view word = tokens[pos].text;
+            if (word == "if" || word == "while" || word == "until" || word == "for" || word == "{") {
+                return parse_compound(item, word);
+            }
+            // One the current construct expects ends its list before this
+            if (is_closing(word)) {
+                return unexpected();
+            }
+            string name;
+            if (function_start(name)) {
+                skip_newlines();
+                if (!is_word(tokens, pos, "{")) return unexpected();
+                if (!parse_compound(item, "{")) return false;
+                item.compound->kind = CompoundKind::Function;
+                item.compound->name = move(name);
+                return true;
+            }
+        }
+
+        size_t start = pos;
+        while (!at_end()) {
+            TokenKind k = kind();
+            bool after_pipe = pos > start && tokens[pos - 1].kind == TokenKind::Pipe;
+            if (ends_item(k) && !(k == TokenKind::Newline && after_pipe)) break;
+            // A closing brace counts in command position or as the last word
+            // before a separator, as in "parallel { a; b }"
+            if (in_block && is_word(tokens, pos, "}") &&
+                (pos == start || after_pipe || pos + 1 == tokens.size() ||
+                 ends_item(tokens[pos + 1].kind))) {
+                break;
+            }
+            pos++;
+        }
+        if (pos == start) {
+            return unexpected();
+        }
+        TokenKind last = tokens[pos - 1].kind;
+        if (last == TokenKind::Pipe || (last == TokenKind::Newline && at_end())) {
+            incomplete = true;
+            return false;
+        }
+        return parse_pipeline(&tokens[start], &tokens[0] + pos, item.pipeline);
+    }
+
+    const vector<Token> &tokens;
+    size_t pos;
+    bool incomplete;
+};
+
+bool parse_list(const vector<Token> &tokens, CommandList &list, bool &incomplete) {
+    ListParser parser(tokens);
+    bool ok = parser.parse(list);
+    incomplete = parser.is_incomplete();
+    return ok;
+}
+
+static string command_output(string_view command);
+
+// Appends the value of the variable reference or command substitution at
+// source[i], which is just after a '$', and moves i past it. Returns false
+// if it is neither.
+static bool expand_variable(string_view source, size_t &i, string &value) {
+    if (i >= source.size()) return false;
+    char c = source[i];
+    if (c == '(') {
+        size_t end = substitution_end(source, i + 1);
+        if (end == string::npos) return false;
+        value += command_output(source.substr(i + 1, end - i - 1));
+        i = end + 1;
+        return true;
+    }
+    if (c == '?') {
+        value += to_string(last_status);
+        i++;
+        return true;
+    }
+    if (rc_recording && (c == '$' || c == '#' || c == '@' || c == '*' ||
+                         isdigit(static_cast<unsigned char>(c)))) {
+        rc_recording->replayable = false;
+    }
+    if (c == '$') {
+        value += to_string(shell_pid);
+        i++;
+        return true;
+    }
+    if (isdigit(static_cast<unsigned char>(c))) {
+        size_t n = c - '0';
+        if (n == 0) {
+            value += "liteshell";
+        } else if (n <= positional_args.size()) {
+            value += positional_args[n - 1];
+        }
+        i++;
+        return true;
+    }
+    if (c == '#') {
+        value += to_string(positional_args.size());
+        i++;
+        return true;
+    }
+    if (c == '@' || c == '*') {
+        for (size_t j = 0; j < positional_args.size(); j++) {
+            if (j > 0) value += ' ';
+            value += positional_args[j];
+        }
+        i++;
+        return true;
+    }
+
+    size_t start = i;
+    bool braced = c == '{';
+    if (braced) start++;
+    size_t end = start;
+    while (end < source.size() && (isalnum(static_cast<unsigned char>(source[end])) ||
+                                   source[end] == '_')) {
+        end++;
+    }
+    if (end == start || (braced && (end >= source.size() || source[end] != '}'))) {
+        return false;
+    }
+    string name(source.substr(start, end - start));
+    if (rc_recording) rc_recording->reads.insert(name);
+    if (const string *var = shell_vars.get(name)) {
+        value += *var;
+    }
+    i = braced ? end + 1 : end;
+    return true;
+}
+
+// Runs the backquoted command starting at source[i], the opening '`', and
+// moves i past the closing one. Inside, a backslash only escapes '\', '`'
+// and '$'.
+static bool expand_backquote(string_view source, size_t &i, string &value) {
+    size_t end = backquote_end(source, i + 1);
+    if (end == string::npos) return false;
+    string command;
+    for (size_t j = i + 1; j < end; j++) {
+        if (source[j] == '\\' && j + 1 < end && strchr("\\`$", source[j + 1])) j++;
+        command += source[j];
+    }
+    value += command_output(command);
+    i = end + 1;
+    return true;
+}
+
+// One word produced by expanding a source word
+struct ExpandedWord {
+    string text;
+    string pattern;     // text with quoted characters backslash-escaped
+    bool glob = false;  // has an unquoted glob character
+};
+
+// Rebuilds a word from its source text with variables and command
+// substitutions expanded. Unquoted expansion results are split on spaces,
+// tabs and newlines when split is set, so one source word may give several
+// words or none. Quoted characters, including the values of quoted
+// expansions, are escaped in pattern so they never glob.
+static void expand_source(string_view source, vector<ExpandedWord> &words, bool split = true) {
+    ExpandedWord word;
+    bool started = false;   // word has content, possibly an empty quoted string
+    auto add = [&](char c, bool quoted) {
+        word.text += c;
+        if (quoted && strchr("*?[]\\", c)) word.pattern += '\\';
+        word.pattern += c;
+        if (!quoted && (c == '*' || c == '?' || c == '[')) word.glob = true;
+        started = true;
+    };
+    auto add_value = [&](const string &value, bool quoted) {
+        for (char c : value) {
+            if (!quoted && split && (c == ' ' || c == '\t' || c == '\n')) {
+                if (started) words.push_back(move(word));
+                word = ExpandedWord();
+                started = false;
+            } else {
+                add(c, quoted);
+            }
+        }
+    };
+    auto add_expansion = [&](size_t &i, bool quoted) {
+        string value;
+        size_t next = i;
+        if (source[i] == '`') {
+            if (!expand_backquote(source, next, value)) return false;
+        } else if (!expand_variable(source, ++next, value)) {
+            return false;
+        }
+        add_value(value, quoted);
+        i = next;
+        return true;
+    };
+
+    size_t n = source.size();
+    size_t i = 0;
+    while (i < n) {
+        char c = source[i];
+        if (c == '\\') {
+            if (i + 1 < n) add(source[i + 1], true);
+            i += 2;
+        } else if (c == '\'') {
+            started = true;
+            for (i++; i < n && source[i] != '\''; i++) add(source[i], true);
+            i++;
+        } else if (c == '"') {
+            started = true;
+            i++;
+            while (i < n && source[i] != '"') {
+                if (source[i] == '\\' && i + 1 < n && strchr("\"\\$`", source[i + 1])) {
+                    add(source[i + 1], true);
+                    i += 2;
+                } else if ((source[i] != '$' && source[i] != '`') || !add_expansion(i, true)) {
+                    add(source[i++], true);
+                }
+            }
+            i++;
+        } else if ((c != '$' && c != '`') || !add_expansion(i, false)) {
+            add(c, false);
+            i++;
+        }
+    }
+    if (started) words.push_back(move(word));
+}
+
+// The text of a word after expansion, without splitting or globbing, as
+// used for assignment values and here-strings
+static string expand_text(const Token &word) {
+    if (word.source.empty()) return string(word.text);
+    vector<ExpandedWord> words;
+    expand_source(word.source, words, false);
+    return words.empty() ? string() : move(words[0].text);
+}
+
+// Expands variables, command substitutions and glob words into argv.
+// Results are kept in storage; a pattern with no match is passed through
+// literally.
+void expand_words(const vector<Token> &words, vector<string_view> &argv, deque<string> &storage) {
+    argv.clear();
+    argv.reserve(words.size());
+    auto add_word = [&](string_view text, string_view pattern, bool glob) {
+        if (!glob) {
+            argv.push_back(text);
+            return;
+        }
+        // What a glob matches can change without the rc changing
+        if (rc_recording) rc_recording->replayable = false;
+        auto matches = expand_wildcards(pattern);
+        if (matches.empty()) {
+            argv.push_back(text);
+            return;
+        }
+        for (auto &match : matches) {
+            storage.push_back(move(match));
+            argv.push_back(storage.back());
+        }
+    };
+
+    vector<ExpandedWord> expanded;
+    for (const auto &word : words) {
+        if (word.source.empty()) {
+            add_word(word.text, word.pattern.empty() ? word.text : word.pattern, word.glob);
+            continue;
+        }
+        expanded.clear();
+        expand_source(word.source, expanded);
+        for (auto &result : expanded) {
+            storage.push_back(move(result.text));
+            string_view text = storage.back();
+            string_view pattern;
+            if (result.glob) {
+                storage.push_back(move(result.pattern));
+                pattern = storage.back();
+            }
+            add_word(text, pattern, result.glob);
+        }
+    }
+}
+
+// Glob engine -----------------------------------------------------------
+
+// Sorted directory listing, reused until the directory's mtime changes
+struct DirListing {
+    struct timespec mtime;
+    ino_t inode;
+    vector<string> names;
+};
+unordered_map<string, DirListing> dir_cache;
+
+// Return the cached listing of dir, re-reading it only if the directory
+// changed since it was cached. Returns nullptr if dir cannot be opened.
+const DirListing *read_dir_cached(const string &dir) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return nullptr;
+    }
+
+    auto it = dir_cache.find(dir);
+    if (it != dir_cache.end() && it->second.inode == st.st_ino &&
+        it->second.mtime.tv_sec == st.st_mtim.tv_sec &&
+        it->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        // A listing taken in the same second as the last change may have
+        // missed a later change with the same coarse timestamp
+        if (time(nullptr) > st.st_mtim.tv_sec + 1) {
+            return &it->second;
+        }
+    }
+
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        return nullptr;
+    }
+
+    DirListing listing;
+    listing.mtime = st.st_mtim;
+    listing.inode = st.st_ino;
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        listing.names.push_back(entry->d_name);
+    }
+    closedir(d);
+    sort(listing.names.begin(), listing.names.end());
+
+    DirListing &slot = dir_cache[dir];
+    slot = move(listing);
+    return &slot;
+}
+
+// Match a bracket expression starting at pattern[p] ('[') against c.
+// Sets p past the closing ']'. Returns -1 if the '[' is unterminated.
+static int match_class(string_view pattern, size_t &p, char c) {
+    size_t i = p + 1;
+    bool negate = false;
+    if (i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^')) {
+        negate = true;
+        i++;
+    }
+
+    bool matched = false;
+    bool first = true;
+    while (i < pattern.size() && (first || pattern[i] != ']')) {
+        first = false;
+        char lo = pattern[i];
+        if (lo == '\\' && i + 1 < pattern.size()) {
+            lo = pattern[++i];
+        }
+        char hi = lo;
+        if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+            hi = pattern[i + 2];
+            if (hi == '\\' && i + 3 < pattern.size()) {
+                hi = pattern[i + 3];
+                i++;
+            }
+            i += 2;
+        }
+        if (lo <= c && c <= hi) {
+            matched = true;
+        }
+        i++;
+    }
+
+    if (i >= pattern.size()) {
+        return -1;
+    }
+    p = i + 1;
+    return matched != negate;
+}
+
+// Match name against a single path component pattern supporting '*', '?',
+// '[...]' and backslash escapes. Iterative: on a mismatch it only resumes
+// from the most recent '*', so there is no recursive backtracking.
+bool glob_match(string_view pattern, string_view name) {
+    size_t p = 0, n = 0;
+    size_t star_p = string_view::npos, star_n = 0;
+
+    while (n < name.size()) {
+        if (p < pattern.size()) {
+            char pc = pattern[p];
+            if (pc == '*') {
+                star_p = ++p;
+                star_n = n;
+                continue;
+            }
+            if (pc == '?') {
+                p++;
+                n++;
+                continue;
+            }
+            if (pc == '[') {
+                size_t next = p;
+                int result = match_class(pattern, next, name[n]);
+                if (result == 1) {
+                    p = next;
+                    n++;
+                    continue;
+                }
+                if (result == -1 && name[n] == '[') {
+                    p++;
+                    n++;
+                    continue;
+                }
+            } else {
+                if (pc == '\\' && p + 1 < pattern.size()) {
+                    pc = pattern[p + 1];
+                    if (pc == name[n]) {
+                        p += 2;
+                        n++;
+                        continue;
+                    }
+                } else if (pc == name[n]) {
+                    p++;
+                    n++;
+                    continue;
+                }
+            }
+        }
+
+        if (star_p == string_view::npos) {
+            return false;
+        }
+        p = star_p;
+        n = ++star_n;
+    }
+
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+static bool has_glob_chars(string_view s) {
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '\\') {
+            i++;
+        } else if (s[i] == '*' || s[i] == '?' || s[i] == '[') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static string unescape_glob(string_view s) {
+    string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '\\' && i + 1 < s.size()) {
+            i++;
+        }
+        out += s[i];
+    }
+    return out;
+}
+
+// Expand a possibly multi-directory pattern such as src/*/*.cpp, one path
+// component at a time. Returns the sorted matches, or an empty vector if
+// nothing matched.
+vector<string> expand_wildcards(string_view pattern) {
+    vector<string> bases(1);
+    size_t pos = 0;
+    if (!pattern.empty() && pattern[0] == '/') {
+        bases[0] = "/";
+        pos = 1;
+    }
+
+    bool check_exists = false;
+    while (pos <= pattern.size() && !bases.empty()) {
+        size_t slash = pattern.find('/', pos);
+        bool last = slash == string_view::npos;
+        string_view component = pattern.substr(pos, last ? string_view::npos : slash - pos);
+        pos = last ? pattern.size() + 1 : slash + 1;
+
+        if (component.empty()) {
+            if (last) {
+                // Trailing slash: keep only directories
+                vector<string> dirs;
+                for (auto &base : bases) {
+                    struct stat st;
+                    if (stat(base.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                        dirs.push_back(move(base));
+                    }
+                }
+                bases.swap(dirs);
+            }
+            continue;
+        }
+
+        if (!has_glob_chars(component)) {
+            string literal = unescape_glob(component);
+            for (auto &base : bases) {
+                base += literal;
+                if (!last) base += '/';
+            }
+            // Entries listed by an earlier component exist, but a literal
+            // component after them still has to be checked
+            check_exists = true;
+            continue;
+        }
+
+        bool show_hidden = component[0] == '.';
+        vector<string> next;
+        for (const auto &base : bases) {
+            const DirListing *listing = read_dir_cached(base.empty() ? "." : base);
+            if (!listing) continue;
+            for (const auto &name : listing->names) {
+                if (name[0] == '.' && !show_hidden) continue;
+                if (glob_match(component, name)) {
+                    next.push_back(base + name);
+                    if (!last) next.back() += '/';
+                }
+            }
+        }
+        bases.swap(next);
+        check_exists = false;
+    }
+
+    vector<string> matches;
+    for (auto &base : bases) {
+        struct stat st;
+        if (check_exists && lstat(base.c_str(), &st) != 0) continue;
+        matches.push_back(move(base));
+    }
+    sort(matches.begin(), matches.end());
+    return matches;
+}
+
+// Drop the hash table if PATH differs from the one it was built against
+void check_hash_path() {
+    const string *path_var = shell_vars.get("PATH");
+    const string &path = path_var ? *path_var : string();
+    if (path != hashed_path) {
+        command_hash.clear();
+        hashed_path = path;
+    }
+}
+
+string search_path(const string &name) {
+    size_t start = 0;
+    while (start <= hashed_path.size()) {
+        size_t end = hashed_path.find(':', start);
+        if (end == string::npos) end = hashed_path.size();
+
+        string dir = hashed_path.substr(start, end - start);
+        string candidate = (dir.empty() ? "." : dir) + "/" + name;
+        struct stat st;
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+            access(candidate.c_str(), X_OK) == 0) {
+            return candidate;
+        }
+        start = end + 1;
+    }
+    return "";
+}
+
+// Resolve a command name to the path to exec, consulting the hash table
+// first. Returns an empty string if the command is not on PATH.
+string lookup_command(const string &name) {
+    if (name.find('/') != string::npos) {
+        return name;
+    }
+
+    check_hash_path();
+    auto it = command_hash.find(name);
+    if (it != command_hash.end()) {
+        it->second.hits++;
+        return it->second.path;
+    }
+
+    string path = search_path(name);
+    if (!path.empty()) {
+        command_hash[name] = {path, 1};
+    }
+    return path;
+}
+
+// Launch an external command with posix_spawn so the shell's address space
+// is never copied. in_fd/out_fd/err_fd, when not -1, become the child's
+// stdin, stdout and stderr; every other shell descriptor is expected to be
+// close-on-exec. args must reference NUL-terminated text.
+// pgid is the process group to join (0 starts a new one, -1 stays in the
+// shell's); take_terminal makes that group the terminal's foreground.
+// envp defaults to the shell's exported variables.
+pid_t spawn_external(const vector<string_view> &args, const FdActions &fds,
+                     pid_t pgid, bool take_terminal, char *const *envp = nullptr) {
+    string name(args[0]);
+    string path = lookup_command(name);
+    if (path.empty()) {
+        cerr << name << ": command not found" << endl;
+        return -1;
+    }
+
+    vector<char*> argv;
+    argv.reserve(args.size() + 1);
+    for (const auto &arg : args) {
+        argv.push_back(const_cast<char*>(arg.data()));
+    }
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+    // Take the terminal before exec so the job cannot read it too early.
+    // This must come before the redirections replace stdin.
+    if (take_terminal) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+#endif
+    for (const auto &fd : fds) {
+        if (fd.source == -1) {
+            posix_spawn_file_actions_addclose(&actions, fd.target);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, fd.source, fd.target);
+        }
+    }
+
+    // The shell ignores SIGPIPE for in-process builtins and the job control
+    // signals for itself; children must not
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t default_signals;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    sigaddset(&default_signals, SIGTSTP);
+    sigaddset(&default_signals, SIGTTIN);
+    sigaddset(&default_signals, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    if (pgid != -1) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    shared_ptr<const EnvironmentBlock> environment;
+    if (!envp) {
+        environment = shell_vars.environment();
+        envp = environment->envp.data();
+    }
+
+    pid_t pid;
+    int err = posix_spawn(&pid, path.c_str(), &actions, &attr, argv.data(), envp);
+    if (err == ENOENT && name.find('/') == string::npos) {
+        // Stale hash entry, search PATH again
+        command_hash.erase(name);
+        path = lookup_command(name);
+        if (!path.empty()) {
+            err = posix_spawn(&pid, path.c_str(), &actions, &attr, argv.data(), envp);
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0) {
+        cerr << name << ": " << strerror(err) << endl;
+        return -1;
+    }
+    return pid;
+}
+
+// Look up a builtin by name; nullptr for anything else
+const Builtin *find_builtin(string_view name) {
+    const Builtin *first = std::begin(builtin_table);
+    const Builtin *last = std::end(builtin_table);
+    const Builtin *it = lower_bound(first, last, name, [](const Builtin &b, string_view n) {
+        return b.name < n;
+    });
+    return it != last && it->name == name ? it : nullptr;
+}
+
+int handle_hash(const vector<string> &args) {
+    check_hash_path();
+
+    if (args.size() == 1) {
+        if (command_hash.empty()) {
+            cout << "hash: hash table empty" << endl;
+            return 0;
+        }
+        vector<string> names;
+        for (const auto &pair : command_hash) {
+            names.push_back(pair.first);
+        }
+        sort(names.begin(), names.end());
+
+        cout << "hits\tcommand" << endl;
+        for (const auto &name : names) {
+            const HashEntry &entry = command_hash[name];
+            cout << "   " << entry.hits << "\t" << entry.path << endl;
+        }
+        return 0;
+    }
+
+    if (args[1] == "-r") {
+        command_hash.clear();
+        return 0;
+    }
+
+    int status = 0;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i].find('/') != string::npos) continue;
+        string path = search_path(args[i]);
+        if (path.empty()) {
+            cerr << "hash: " << args[i] << ": not found" << endl;
+            status = 1;
+        } else {
+            command_hash[args[i]] = {path, 0};
+        }
+    }
+    return status;
+}
+
+void set_alias(const string &name, const string &value, bool from_rc) {
+    auto body = make_shared<CommandLine>();
+    lex_command(value, *body);
+    auto it = aliases.find(name);
+    if (it != aliases.end()) {
+        it->second = {value, move(body), from_rc};
+        aliases_dirty = true;
+    } else {
+        aliases.emplace(name, Alias{value, move(body), from_rc});
+    }
+    alias_memo.clear();
+    clear_parse_cache();
+}
+
+static bool at_command_start(const vector<Token> &tokens, size_t i) {
+    if (i == 0) return true;
+    if (i == 1 && tokens[0].kind == TokenKind::Word && !tokens[0].quoted && tokens[0].text == "time") {
+        return true;
+    }
+    switch (tokens[i - 1].kind) {
+    case TokenKind::Pipe:
+    case TokenKind::OrIf:
+    case TokenKind::Amp:
+    case TokenKind::AndIf:
+    case TokenKind::Semi:
+    case TokenKind::Newline:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void expand_alias_tokens(const vector<Token> &tokens, vector<Token> &out,
+                                vector<shared_ptr<const void>> &pins,
+                                vector<string_view> &active, bool &blocked);
+
+// Expands one alias, recursing into command words of its body. A name that
+// is already being expanded is left as a plain word, like bash. Results that
+// did not hit such a cycle do not depend on the caller and are memoized.
+static shared_ptr<const AliasExpansion> expand_alias(const Alias &alias, string_view name,
+                                                     vector<string_view> &active, bool &blocked) {
+    auto memo = alias_memo.find(string(name));
+    if (memo != alias_memo.end()) {
+        return memo->second;
+    }
+
+    auto expansion = make_shared<AliasExpansion>();
+    expansion->pins.push_back(alias.body);
+    bool inner_blocked = false;
+    active.push_back(name);
+    expand_alias_tokens(alias.body->tokens, expansion->tokens, expansion->pins,
+                        active, inner_blocked);
+    active.pop_back();
+
+    if (inner_blocked) {
+        blocked = true;
+    } else {
+        alias_memo.emplace(string(name), expansion);
+    }
+    return expansion;
+}
+
+static void expand_alias_tokens(const vector<Token> &tokens, vector<Token> &out,
+                                vector<shared_ptr<const void>> &pins,
+                                vector<string_view> &active, bool &blocked) {
+    for (size_t i = 0; i < tokens.size(); i++) {
+        const Token &token = tokens[i];
+        if (token.kind != TokenKind::Word || token.quoted || !at_command_start(tokens, i)) {
+            out.push_back(token);
+            continue;
+        }
+        auto it = aliases.find(string(token.text));
+        if (it == aliases.end()) {
+            out.push_back(token);
+            continue;
+        }
+        if (find(active.begin(), active.end(), token.text) != active.end()) {
+            blocked = true;
+            out.push_back(token);
+            continue;
+        }
+        auto expansion = expand_alias(it->second, it->first, active, blocked);
+        out.insert(out.end(), expansion->tokens.begin(), expansion->tokens.end());
+        pins.push_back(expansion);
+    }
+}
+
+void expand_aliases(CommandLine &line) {
+    if (aliases.empty()) {
+        return;
+    }
+    bool found = false;
+    for (size_t i = 0; i < line.tokens.size() && !found; i++) {
+        const Token &token = line.tokens[i];
+        found = token.kind == TokenKind::Word && !token.quoted &&
+                at_command_start(line.tokens, i) && aliases.count(string(token.text));
+    }
+    if (!found) {
+        return;
+    }
+
+    vector<Token> expanded;
+    vector<string_view> active;
+    bool blocked = false;
+    expand_alias_tokens(line.tokens, expanded, line.pins, active, blocked);
+    line.tokens.swap(expanded);
+}
+
+static vector<const pair<const string, Alias>*> sorted_aliases() {
+    vector<const pair<const string, Alias>*> sorted;
+    for (const auto &entry : aliases) {
+        sorted.push_back(&entry);
+    }
+    sort(sorted.begin(), sorted.end(),
+         [](const auto *a, const auto *b) { return a->first < b->first; });
+    return sorted;
+}
+
+void load_aliases() {
+    ifstream alias_file(ALIAS_FILE);
+    if (!alias_file) {
+        return;
+    }
+    string line;
+    while (getline(alias_file, line)) {
+        size_t pos = line.find('=');
+        if (pos != string::npos && pos != 0) {
+            set_alias(line.substr(0, pos), line.substr(pos + 1));
+        } else {
+            aliases_dirty = true;
+        }
+    }
+}
+
+// Rewrites the alias file with one line per live alias
+void save_aliases() {
+    if (!aliases_dirty) {
+        return;
+    }
+    string tmp = ALIAS_FILE + ".tmp";
+    ofstream out(tmp, ios::trunc);
+    for (const auto *entry : sorted_aliases()) {
+        if (entry->second.from_rc) continue;
+        out << entry->first << "=" << entry->second.value << '\n';
+    }
+    out.close();
+    if (!out || rename(tmp.c_str(), ALIAS_FILE.c_str()) != 0) {
+        perror("alias");
+        unlink(tmp.c_str());
+        return;
+    }
+    aliases_dirty = false;
+}
+
+int handle_alias(const vector<string> &args) {
+    if (args.size() == 1) {
+        for (const auto *entry : sorted_aliases()) {
+            cout << entry->first << "=" << entry->second.value << endl;
+        }
+    } else if (args.size() == 2) {
+        string definition = args[1];
+        size_t equal_pos = definition.find('=');
+        if (equal_pos == string::npos || equal_pos == 0) {
+            cerr << "alias: syntax error, expected NAME=VALUE" << endl;
+            return 1;
+        }
+        
+        string name = definition.substr(0, equal_pos);
+        string value = definition.substr(equal_pos + 1);
+        
+        if (!value.empty()) {
+            if ((value.front() == '\'' && value.back() == '\'') || 
+                (value.front() == '"' && value.back() == '"')) {
+                value = value.substr(1, value.size() - 2);
+            }
+        }
+        
+        set_alias(name, value, rc_recording != nullptr);
+        // Scripts and -c leave the alias file alone, as they never load it
+        if (rc_recording || !interactive) {
+            return 0;
+        }
+
+        ofstream alias_file(ALIAS_FILE, ios::app);
+        if (alias_file) {
+            alias_file << name << "=" << value << endl;
+        }
+    } else {
+        cerr << "alias: too many arguments" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+int handle_unalias(const vector<string> &args) {
+    if (args.size() < 2) {
+        cerr << "unalias: usage: unalias NAME..." << endl;
+        return 1;
+    }
+    int status = 0;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (aliases.erase(args[i]) == 0) {
+            cerr << "unalias: " << args[i] << ": not found" << endl;
+            status = 1;
+        } else {
+            aliases_dirty = true;
+        }
+    }
+    alias_memo.clear();
+    clear_parse_cache();
+    return status;
+}
+
+int handle_history(const vector<string> &args) {
+    int show_count = command_history.size();
+    
+    if (args.size() > 1 && (args[1] == "-s" || args[1] == "-p")) {
+        if (args.size() != 3) {
+            cerr << "history: usage: history -s substring | history -p prefix" << endl;
+            return 1;
+        }
+        vector<uint64_t> found = history_index.search(command_history, args[2], args[1] == "-p",
+                                                      command_history.size());
+        uint64_t first = command_history.first_seq();
+        for (auto it = found.rbegin(); it != found.rend(); ++it) {
+            cout << " " << *it - first + 1 << "  " << command_history.at_seq(*it) << "\n";
+        }
+        cout.flush();
+        return found.empty() ? 1 : 0;
+    }
+    
+    if (args.size() > 1) {
+        try {
+            show_count = stoi(args[1]);
+            if (show_count < 0) {
+                cout << "history: count must be positive" << endl;
+                return 1;
+            }
+            show_count = min(show_count, (int)command_history.size());
+        } catch (const exception&) {
+            cout << "history: " << args[1] << ": numeric argument required" << endl;
+            return 1;
+        }
+    }
+    
+    int start_index = max(0, (int)command_history.size() - show_count);
+    for (size_t i = start_index; i < command_history.size(); i++) {
+        cout << " " << i + 1 << "  " << command_history[i] << endl;
+    }
+    return 0;
+}
+
+int handle_pwd(const vector<string> &args) {
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd))) {
+        cout << cwd << endl;
+    } else {
+        perror("pwd");
+        return 1;
+    }
+    return 0;
+}
+
+// Script builtins --------------------------------------------------------
+// echo, printf, test/[ and true/false run inside the shell, so conditions
+// and output in loops do not fork. Each writes its output in one piece.
+
+int handle_true(const vector<string> &args) {
+    return 0;
+}
+
+int handle_false(const vector<string> &args) {
+    return 1;
+}
+
+// Appends s with backslash escapes interpreted. Octal escapes are \0nnn
+// when zero_octal is set (echo -e) and \nnn when plain_octal is (printf
+// formats); printf %b takes both. Returns false at \c, after which nothing
+// more is to be written.
+static bool append_escaped(string &out, string_view s, bool zero_octal, bool plain_octal) {
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] != '\\' || i + 1 == s.size()) {
+            out += s[i];
+            continue;
+        }
+        char c = s[++i];
+        switch (c) {
+        case 'a': out += '\a'; break;
+        case 'b': out += '\b'; break;
+        case 'c': return false;
+        case 'e': case 'E': out += '\033'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'v': out += '\v'; break;
+        case '\\': out += '\\'; break;
+        case 'x': {
+            size_t j = i + 1;
+            int value = 0;
+            for (; j < s.size() && j < i + 3 && isxdigit((unsigned char)s[j]); j++) {
+                value = value * 16 + (isdigit((unsigned char)s[j]) ? s[j] - '0' : tolower(s[j]) - 'a' + 10);
+            }
+            if (j == i + 1) {
+                out += "\\x";
+            } else {
+                out += (char)value;
+                i = j - 1;
+            }
+            break;
+        }
+        default:
+            bool zero = zero_octal && c == '0';
+            if (c >= '0' && c <= '7' && (zero || plain_octal)) {
+                size_t j = zero ? i + 1 : i;
+                size_t stop = min(s.size(), j + 3);
+                int value = 0;
+                for (; j < stop && s[j] >= '0' && s[j] <= '7'; j++) {
+                    value = value * 8 + (s[j] - '0');
+                }
+                out += (char)value;
+                i = j - 1;
+            } else {
+                out += '\\';
+                out += c;
+            }
+        }
+    }
+    return true;
+}
+
+int handle_echo(const vector<string> &args) {
+    bool newline = true;
+    bool escapes = false;
+    size_t i = 1;
+    // Leading words such as -n, -e or -ne are options, as in bash
+    for (; i < args.size(); i++) {
+        const string &arg = args[i];
+        if (arg.size() < 2 || arg[0] != '-' || arg.find_first_not_of("neE", 1) != string::npos) break;
+        for (size_t j = 1; j < arg.size(); j++) {
+            if (arg[j] == 'n') {
+                newline = false;
+            } else {
+                escapes = arg[j] == 'e';
+            }
+        }
+    }
+
+    string out;
+    bool more = true;
+    for (size_t first = i; i < args.size() && more; i++) {
+        if (i > first) out += ' ';
+        if (escapes) {
+            more = append_escaped(out, args[i], true, false);
+        } else {
+            out += args[i];
+        }
+    }
+    if (newline && more) out += '\n';
+    cout.write(out.data(), out.size());
+    return 0;
+}
+
+// Formats one value with a printf conversion spec such as "%-8.3s"
+template <typename T>
+static void append_printf(string &out, const string &spec, T value) {
+    int len = snprintf(nullptr, 0, spec.c_str(), value);
+    if (len <= 0) return;
+    size_t at = out.size();
+    out.resize(at + len + 1);
+    snprintf(&out[at], len + 1, spec.c_str(), value);
+    out.resize(at + len);
+}
+
+// printf FORMAT [ARG...]: the format is reused until the arguments run out;
+// missing arguments read as "" or 0
+int handle_printf(const vector<string> &args) {
+    if (args.size() < 2) {
+        cerr << "printf: usage: printf FORMAT [ARG...]" << endl;
+        return 2;
+    }
+    const string &format = args[1];
+    size_t next = 2;
+    int status = 0;
+    static const string empty;
+    auto take = [&]() -> const string & {
+        return next < args.size() ? args[next++] : empty;
+    };
+    // Numbers may be decimal, 0x hex, 0 octal or 'c for a character code
+    auto number = [&](const string &arg) -> long long {
+        if (arg.empty()) return 0;
+        if (arg[0] == '\'' || arg[0] == '"') {
+            return arg.size() > 1 ? (unsigned char)arg[1] : 0;
+        }
+        char *end;
+        errno = 0;
+        long long value = strtoll(arg.c_str(), &end, 0);
+        if (*end != '\0' || errno != 0) {
+            cerr << "printf: " << arg << ": invalid number" << endl;
+            status = 1;
+        }
+        return value;
+    };
+
+    string out;
+    bool more = true;
+    do {
+        size_t before = next;
+        for (size_t i = 0; i < format.size() && more; i++) {
+            size_t percent = format.find('%', i);
+            if (percent != i) {
+                size_t stop = percent == string::npos ? format.size() : percent;
+                more = append_escaped(out, string_view(format).substr(i, stop - i), false, true);
+                i = stop - 1;
+                continue;
+            }
+            if (i + 1 < format.size() && format[i + 1] == '%') {
+                out += '%';
+                i++;
+                continue;
+            }
+
+            // Flags, width and precision, with '*' taken from the arguments
+            string spec = "%";
+            size_t j = i + 1;
+            while (j < format.size() && strchr("-+ #0", format[j])) spec += format[j++];
+            for (bool precision = false;; precision = true) {
+                if (j < format.size() && format[j] == '*') {
+                    spec += to_string(number(take()));
+                    j++;
+                } else {
+                    while (j < format.size() && isdigit((unsigned char)format[j])) spec += format[j++];
+                }
+                if (precision || j >= format.size() || format[j] != '.') break;
+                spec += format[j++];
+            }
+            if (j >= format.size()) {
+                cerr << "printf: " << format.substr(i) << ": missing format character" << endl;
+                return 1;
+            }
+
+            char conversion = format[j];
+            i = j;
+            switch (conversion) {
+            case 's':
+                append_printf(out, spec + 's', take().c_str());
+                break;
+            case 'c':
+                append_printf(out, spec + 's', take().substr(0, 1).c_str());
+                break;
+            case 'b': {
+                string text;
+                more = append_escaped(text, take(), true, true);
+                append_printf(out, spec + 's', text.c_str());
+                break;
+            }
+            case 'd':
+            case 'i':
+                append_printf(out, spec + "ll" + conversion, number(take()));
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                append_printf(out, spec + "ll" + conversion, (unsigned long long)number(take()));
+                break;
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+                const string &arg = take();
+                char *end;
+                double value = strtod(arg.c_str(), &end);
+                if (!arg.empty() && *end != '\0') {
+                    cerr << "printf: " << arg << ": invalid number" << endl;
+                    status = 1;
+                }
+                append_printf(out, spec + conversion, value);
+                break;
+            }
+            default:
+                cout.write(out.data(), out.size());
+                cerr << "printf: %" << conversion << ": invalid format character" << endl;
+                return 1;
+            }
+        }
+        // A format without conversions would otherwise repeat forever
+        if (next == before) break;
+    } while (more && next < args.size());
+
+    cout.write(out.data(), out.size());
+    return status;
+}
+
+// Evaluates a test/[ expression by recursive descent: -o binds looser than
+// -a, which binds looser than !, with ( ) for grouping. A binary operator
+// in second position is tried first, so [ "(" = "(" ] and [ -n = x ] work.
+struct TestExpression {
+    const vector<string> &args;
+    size_t pos;
+    size_t end;
+    bool error = false;
+
+    static bool is_unary(const string &op) {
+        return op.size() == 2 && op[0] == '-' && strchr("bcdefghLkprsStuwxzn", op[1]);
+    }
+
+    static bool is_binary(const string &op) {
+        static const string_view ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+                                          "-gt", "-ge", "-nt", "-ot", "-ef"};
+        return std::find(std::begin(ops), std::end(ops), op) != std::end(ops);
+    }
+
+    bool binary_at(size_t i) const {
+        return i + 2 < end && is_binary(args[i + 1]);
+    }
+
+    void fail(const string &message) {
+        if (!error) cerr << args[0] << ": " << message << endl;
+        error = true;
+    }
+
+    bool or_expr() {
+        bool value = and_expr();
+        while (!error && pos < end && args[pos] == "-o") {
+            pos++;
+            value = and_expr() || value;
+        }
+        return value;
+    }
+
+    bool and_expr() {
+        bool value = not_expr();
+        while (!error && pos < end && args[pos] == "-a") {
+            pos++;
+            value = not_expr() && value;
+        }
+        return value;
+    }
+
+    bool not_expr() {
+        if (pos + 1 < end && args[pos] == "!" && !binary_at(pos)) {
+            pos++;
+            return !not_expr();
+        }
+        return primary();
+    }
+
+    bool primary() {
+        if (pos >= end) {
+            fail("argument expected");
+            return false;
+        }
+        if (binary_at(pos)) {
+            pos += 3;
+            return binary(args[pos - 3], args[pos - 2], args[pos - 1]);
+        }
+        const string &word = args[pos];
+        if (word == "(" && pos + 1 < end) {
+            pos++;
+            bool value = or_expr();
+            if (pos < end && args[pos] == ")") {
+                pos++;
+            } else {
+                fail("')' expected");
+            }
+            return value;
+        }
+        if (is_unary(word) && pos + 1 < end) {
+            pos += 2;
+            return unary(word[1], args[pos - 1]);
+        }
+        pos++;
+        return !word.empty();
+    }
+
+    long long integer(const string &arg) {
+        char *end_ptr;
+        errno = 0;
+        long long value = strtoll(arg.c_str(), &end_ptr, 10);
+        if (arg.empty() || *end_ptr != '\0' || errno != 0) {
+            fail(arg + ": integer expression expected");
+        }
+        return value;
+    }
+
+    bool unary(char op, const string &arg) {
+        if (op == 'z') return arg.empty();
+        if (op == 'n') return !arg.empty();
+        if (op == 't') return isatty((int)integer(arg));
+
+        struct stat st;
+        bool link = op == 'h' || op == 'L';
+        if ((link ? lstat(arg.c_str(), &st) : stat(arg.c_str(), &st)) != 0) return false;
+        switch (op) {
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'e': return true;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'g': return st.st_mode & S_ISGID;
+        case 'h': case 'L': return S_ISLNK(st.st_mode);
+        case 'k': return st.st_mode & S_ISVTX;
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'r': return access(arg.c_str(), R_OK) == 0;
+        case 's': return st.st_size > 0;
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 'u': return st.st_mode & S_ISUID;
+        case 'w': return access(arg.c_str(), W_OK) == 0;
+        case 'x': return access(arg.c_str(), X_OK) == 0;
+        }
+        return false;
+    }
+
+    bool binary(const string &left, const string &op, const string &right) {
+        if (op == "=" || op == "==") return left == right;
+        if (op == "!=") return left != right;
+        if (op == "<") return left < right;
+        if (op == ">") return left > right;
+        if (op == "-nt" || op == "-ot" || op == "-ef") {
+            struct stat a, b;
+            bool has_a = stat(left.c_str(), &a) == 0;
+            bool has_b = stat(right.c_str(), &b) == 0;
+            if (op == "-ef") return has_a && has_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+            if (!has_a || !has_b) return op == "-nt" ? has_a : has_b;
+            auto newer = [](const struct stat &x, const struct stat &y) {
+                return x.st_mtim.tv_sec != y.st_mtim.tv_sec ? x.st_mtim.tv_sec > y.st_mtim.tv_sec
+                                                            : x.st_mtim.tv_nsec > y.st_mtim.tv_nsec;
+            };
+            return op == "-nt" ? newer(a, b) : newer(b, a);
+        }
+        long long l = integer(left);
+        long long r = integer(right);
+        if (op == "-eq") return l == r;
+        if (op == "-ne") return l != r;
+        if (op == "-lt") return l < r;
+        if (op == "-le") return l <= r;
+        if (op == "-gt") return l > r;
+        return l >= r;
+    }
+};
+
+// test EXPR or [ EXPR ]: 0 when true, 1 when false, 2 on a bad expression
+int handle_test(const vector<string> &args) {
+    size_t end = args.size();
+    if (args[0] == "[") {
+        if (args.back() != "]") {
+            cerr << "[: missing ']'" << endl;
+            return 2;
+        }
+        end--;
+    }
+    if (end == 1) return 1;
+
+    TestExpression test{args, 1, end};
+    bool value = test.or_expr();
+    if (!test.error && test.pos < end) {
+        test.fail(args[test.pos] + ": unexpected argument");
+    }
+    return test.error ? 2 : value ? 0 : 1;
+}
+
+// ls builtin ------------------------------------------------------------
+
+struct LsOptions {
+    bool show_all = false;
+    bool long_format = false;
+    bool color = false;
+    bool recursive = false;
+    // Off inside the directory-reader pool, which is already parallel
+    bool parallel_stat = true;
+};
+
+struct LsEntry {
+    string name;
+    unsigned char type;
+    bool have_stat;
+    struct stat st;
+};
+
+// Directories with at least this many entries are stat'ed for -l by several
+// threads, which hides per-call latency on network filesystems
+const size_t LS_PARALLEL_STAT_MIN = 4096;
+
+// The colour for an entry. d_type alone settles directories and special
+// files; regular files and links need the mode, fetched with fstatat on the
+// directory fd only then.
+static const string &ls_color(int dir_fd, LsEntry &entry) {
+    static const string none;
+    static const string dir = Colors::BLUE + Colors::BOLD;
+
+    if (entry.type != DT_DIR && entry.type != DT_REG &&
+        entry.type != DT_LNK && entry.type != DT_UNKNOWN) {
+        return none;
+    }
+
+    mode_t mode;
+    if (entry.type == DT_DIR) {
+        mode = S_IFDIR;
+    } else {
+        struct stat st;
+        if (fstatat(dir_fd, entry.name.c_str(), &st, 0) != 0) return none;
+        mode = st.st_mode;
+    }
+
+    if (S_ISDIR(mode)) return dir;
+    if (mode & S_IXUSR) return Colors::GREEN;
+    if (S_ISREG(mode)) {
+        size_t dot_pos = entry.name.rfind('.');
+        if (dot_pos != string::npos) {
+            string_view ext = string_view(entry.name).substr(dot_pos + 1);
+            if (ext == "c" || ext == "cpp" || ext == "h") return Colors::CYAN;
+            if (ext == "jpg" || ext == "png" || ext == "gif") return Colors::MAGENTA;
+            if (ext == "zip" || ext == "tar" || ext == "gz") return Colors::RED;
+        }
+    }
+    return none;
+}
+
+static void stat_entries(int dir_fd, vector<LsEntry> &entries, bool parallel) {
+    auto stat_range = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            LsEntry &entry = entries[i];
+            entry.have_stat = fstatat(dir_fd, entry.name.c_str(), &entry.st, AT_SYMLINK_NOFOLLOW) == 0;
+        }
+    };
+
+    size_t workers = min<size_t>(8, thread::hardware_concurrency());
+    if (!parallel || entries.size() < LS_PARALLEL_STAT_MIN || workers < 2) {
+        stat_range(0, entries.size());
+        return;
+    }
+
+    vector<thread> threads;
+    size_t chunk = (entries.size() + workers - 1) / workers;
+    for (size_t begin = 0; begin < entries.size(); begin += chunk) {
+        threads.emplace_back(stat_range, begin, min(entries.size(), begin + chunk));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
+// The name caches are shared by the directory-reader threads
+static mutex name_cache_mutex;
+
+static const string &user_name(uid_t uid) {
+    static unordered_map<uid_t, string> names;
+    lock_guard<mutex> lock(name_cache_mutex);
+    auto it = names.find(uid);
+    if (it == names.end()) {
+        struct passwd *pw = getpwuid(uid);
+        it = names.emplace(uid, pw ? pw->pw_name : to_string(uid)).first;
+    }
+    return it->second;
+}
+
+static const string &group_name(gid_t gid) {
+    static unordered_map<gid_t, string> names;
+    lock_guard<mutex> lock(name_cache_mutex);
+    auto it = names.find(gid);
+    if (it == names.end()) {
+        struct group *gr = getgrgid(gid);
+        it = names.emplace(gid, gr ? gr->gr_name : to_string(gid)).first;
+    }
+    return it->second;
+}
+
+static void format_mode(mode_t mode, char *out) {
+    out[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' :
+             S_ISBLK(mode) ? 'b' : S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's' : '-';
+    const char *rwx = "rwxrwxrwx";
+    for (int i = 0; i < 9; i++) {
+        out[i + 1] = (mode & (0400 >> i)) ? rwx[i] : '-';
+    }
+    if (mode & S_ISUID) out[3] = (mode & S_IXUSR) ? 's' : 'S';
+    if (mode & S_ISGID) out[6] = (mode & S_IXGRP) ? 's' : 'S';
+    if (mode & S_ISVTX) out[9] = (mode & S_IXOTH) ? 't' : 'T';
+    out[10] = '\0';
+}
+
+// Append entries in long format: metadata comes from one stat pass, then
+// column widths are measured and every line is formatted into out
+static void format_long(int dir_fd, vector<LsEntry> &entries, const LsOptions &opts, string &out) {
+    stat_entries(dir_fd, entries, opts.parallel_stat);
+
+    size_t link_width = 1, user_width = 1, group_width = 1, size_width = 1;
+    long long blocks = 0;
+    for (const auto &entry : entries) {
+        if (!entry.have_stat) continue;
+        link_width = max(link_width, to_string(entry.st.st_nlink).size());
+        user_width = max(user_width, user_name(entry.st.st_uid).size());
+        group_width = max(group_width, group_name(entry.st.st_gid).size());
+        size_width = max(size_width, to_string(entry.st.st_size).size());
+        blocks += entry.st.st_blocks;
+    }
+
+    out += "total " + to_string(blocks / 2) + "\n";
+
+    time_t now = time(nullptr);
+    char line[512];
+    for (auto &entry : entries) {
+        if (!entry.have_stat) {
+            out += "?????????? ? ? ? ? ? " + entry.name + "\n";
+            continue;
+        }
+
+        char mode[11];
+        format_mode(entry.st.st_mode, mode);
+
+        char date[32];
+        struct tm tm;
+        localtime_r(&entry.st.st_mtime, &tm);
+        bool recent = entry.st.st_mtime <= now && now - entry.st.st_mtime < 180 * 24 * 3600;
+        strftime(date, sizeof(date), recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+
+        snprintf(line, sizeof(line), "%s %*lu %-*s %-*s %*lld %s ",
+                 mode, (int)link_width, (unsigned long)entry.st.st_nlink,
+                 (int)user_width, user_name(entry.st.st_uid).c_str(),
+                 (int)group_width, group_name(entry.st.st_gid).c_str(),
+                 (int)size_width, (long long)entry.st.st_size, date);
+        out += line;
+
+        if (opts.color) {
+            if (S_ISDIR(entry.st.st_mode)) entry.type = DT_DIR;
+            const string &color = ls_color(dir_fd, entry);
+            out += color;
+            out += entry.name;
+            if (!color.empty()) out += Colors::RESET;
+        } else {
+            out += entry.name;
+        }
+
+        if (S_ISLNK(entry.st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t n = readlinkat(dir_fd, entry.name.c_str(), target, sizeof(target));
+            if (n >= 0) {
+                out += " -> ";
+                out.append(target, n);
+            }
+        }
+        out += '\n';
+    }
+}
+
+// List one directory into out. Names come from readdir with their d_type,
+// so the short listing only stats what the colour needs. With subdirs set,
+// the names of subdirectories (symlinks excluded) are collected for -R.
+bool list_directory(const string &path, const LsOptions &opts, string &out,
+                    vector<string> *subdirs) {
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+        return false;
+    }
+    int dir_fd = dirfd(dir);
+
+    vector<LsEntry> entries;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != nullptr) {
+        if (!opts.show_all && ent->d_name[0] == '.') continue;
+        entries.push_back({ent->d_name, ent->d_type, false, {}});
+    }
+    sort(entries.begin(), entries.end(), [](const LsEntry &a, const LsEntry &b) {
+        return a.name < b.name;
+    });
+
+    if (subdirs) {
+        for (const auto &entry : entries) {
+            if (entry.name == "." || entry.name == "..") continue;
+            bool is_dir = entry.type == DT_DIR;
+            if (entry.type == DT_UNKNOWN) {
+                struct stat st;
+                is_dir = fstatat(dir_fd, entry.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                         S_ISDIR(st.st_mode);
+            }
+            if (is_dir) subdirs->push_back(entry.name);
+        }
+    }
+
+    if (opts.long_format) {
+        format_long(dir_fd, entries, opts, out);
+    } else if (opts.color) {
+        // Terminal output: colored names on one line
+        for (auto &entry : entries) {
+            out += ls_color(dir_fd, entry);
+            out += entry.name;
+            out += Colors::RESET;
+            out += ' ';
+        }
+        out += '\n';
+    } else {
+        for (const auto &entry : entries) {
+            out += entry.name;
+            out += '\n';
+        }
+    }
+
+    closedir(dir);
+    return true;
+}
+
+// A directory to list. Workers fill in out and children; the main thread
+// prints nodes in pre-order as soon as each one and all before it are done.
+struct LsNode {
+    string path;
+    string out;
+    vector<LsNode*> children;
+    int error = 0;
+    bool done = false;
+};
+
+// Pool of directory readers with one task deque per worker. A worker pops
+// its own newest task (depth-first, so output order is reached early) and,
+// when empty, steals the oldest task from another worker.
+class LsReaderPool {
+public:
+    LsReaderPool(const LsOptions &opts, size_t workers) : opts(opts), queues(workers), pending(0) {
+        this->opts.parallel_stat = false;
+    }
+
+    void start() {
+        for (size_t i = 0; i < queues.size(); i++) {
+            threads.emplace_back(&LsReaderPool::run, this, i);
+        }
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(state_mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    LsNode *add_root(const string &path) {
+        LsNode *node = new_node(path);
+        push(0, node);
+        return node;
+    }
+
+    // Block until node has been listed
+    void wait(LsNode *node) {
+        unique_lock<mutex> lock(state_mutex);
+        node_done.wait(lock, [node] { return node->done; });
+    }
+
+    bool is_done(LsNode *node) {
+        lock_guard<mutex> lock(state_mutex);
+        return node->done;
+    }
+
+private:
+    struct TaskQueue {
+        mutex m;
+        deque<LsNode*> tasks;
+    };
+
+    LsNode *new_node(const string &path) {
+        lock_guard<mutex> lock(nodes_mutex);
+        nodes.emplace_back();
+        nodes.back().path = path;
+        return &nodes.back();
+    }
+
+    void push(size_t worker, LsNode *node) {
+        {
+            lock_guard<mutex> lock(queues[worker].m);
+            queues[worker].tasks.push_back(node);
+        }
+        {
+            lock_guard<mutex> lock(state_mutex);
+            pending++;
+        }
+        work_ready.notify_one();
+    }
+
+    LsNode *take(size_t worker) {
+        {
+            TaskQueue &own = queues[worker];
+            lock_guard<mutex> lock(own.m);
+            if (!own.tasks.empty()) {
+                LsNode *node = own.tasks.back();
+                own.tasks.pop_back();
+                return node;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            TaskQueue &victim = queues[(worker + i) % queues.size()];
+            lock_guard<mutex> lock(victim.m);
+            if (!victim.tasks.empty()) {
+                LsNode *node = victim.tasks.front();
+                victim.tasks.pop_front();
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    void run(size_t worker) {
+        while (true) {
+            LsNode *node = take(worker);
+            if (!node) {
+                unique_lock<mutex> lock(state_mutex);
+                if (stopping) return;
+                work_ready.wait_for(lock, chrono::milliseconds(10));
+                continue;
+            }
+            process(worker, node);
+        }
+    }
+
+    void process(size_t worker, LsNode *node) {
+        vector<string> subdirs;
+        string out;
+        int error = 0;
+        if (!list_directory(node->path, opts, out, opts.recursive ? &subdirs : nullptr)) {
+            error = errno;
+        }
+
+        vector<LsNode*> children;
+        for (const auto &name : subdirs) {
+            string child = node->path;
+            if (child.back() != '/') child += '/';
+            children.push_back(new_node(child + name));
+        }
+
+        {
+            lock_guard<mutex> lock(state_mutex);
+            node->out = move(out);
+            node->error = error;
+            node->children = children;
+            node->done = true;
+            pending--;
+        }
+        node_done.notify_all();
+
+        // Queue children newest-last so this worker reads the first one next
+        for (auto it = children.rbegin(); it != children.rend(); ++it) {
+            push(worker, *it);
+        }
+    }
+
+    LsOptions opts;
+    vector<TaskQueue> queues;
+    vector<thread> threads;
+    deque<LsNode> nodes;
+    mutex nodes_mutex;
+    mutex state_mutex;
+    condition_variable work_ready;
+    condition_variable node_done;
+    size_t pending;
+    bool stopping = false;
+};
+
+// Flush buffered listing output once it is big enough to be worth a write
+static void ls_flush(string &out, bool force) {
+    if (out.empty() || (!force && out.size() < 64 * 1024)) return;
+    cout << out;
+    cout.flush();
+    out.clear();
+}
+
+int handle_ls(const vector<string> &args) {
+    LsOptions opts;
+    opts.color = isatty(STDOUT_FILENO) && !capturing_output;
+    
+    int status = 0;
+    vector<string> paths;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i][0] == '-' && args[i].size() > 1) {
+            for (char c : args[i].substr(1)) {
+                if (c == 'a') opts.show_all = true;
+                if (c == 'l') opts.long_format = true;
+                if (c == 'C') opts.color = true;
+                if (c == 'R') opts.recursive = true;
+            }
+        } else {
+            paths.push_back(args[i]);
+        }
+    }
+    
+    if (paths.empty()) {
+        paths.push_back(".");
+    }
+    
+    // Files named on the command line are listed first, then directories
+    string out;
+    vector<string> dirs;
+    for (const auto &path : paths) {
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+            out += path;
+            out += '\n';
+        } else {
+            dirs.push_back(path);
+        }
+    }
+
+    bool headers = opts.recursive || paths.size() > 1;
+    if (dirs.size() == 1 && !opts.recursive) {
+        if (headers) out += dirs[0] + ":\n";
+        if (!list_directory(dirs[0], opts, out, nullptr)) {
+            ls_flush(out, true);
+            cerr << "ls: " << dirs[0] << ": " << strerror(errno) << endl;
+            status = 1;
+        }
+        ls_flush(out, true);
+        return status;
+    }
+
+    // Several directories or a recursive listing: read them in parallel and
+    // print each directory's buffer in deterministic pre-order
+    size_t workers = max<size_t>(2, min<size_t>(8, thread::hardware_concurrency()));
+    LsReaderPool pool(opts, workers);
+    vector<LsNode*> stack;
+    for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+        stack.push_back(pool.add_root(*it));
+    }
+    pool.start();
+
+    bool first = out.empty();
+    while (!stack.empty()) {
+        LsNode *node = stack.back();
+        stack.pop_back();
+        if (!pool.is_done(node)) {
+            // Stream the completed prefix before blocking on the next node
+            ls_flush(out, true);
+            pool.wait(node);
+        }
+
+        if (!first) out += '\n';
+        first = false;
+        if (node->error) {
+            ls_flush(out, true);
+            cerr << "ls: " << node->path << ": " << strerror(node->error) << endl;
+            status = 1;
+        } else {
+            if (headers) out += node->path + ":\n";
+            out += node->out;
+            string().swap(node->out);
+        }
+        for (auto it = node->children.rbegin(); it != node->children.rend(); ++it) {
+            stack.push_back(*it);
+        }
+        ls_flush(out, false);
+    }
+
+    pool.stop();
+    ls_flush(out, true);
+    return status;
+}
+
+int handle_cd(const vector<string> &args) {
+    if (in_subshell) {
+        cerr << "cd: cannot be used in a pipeline" << endl;
+        return 1;
+    }
+
+    if (args.size() == 1) {
+        const string *home = shell_vars.get("HOME");
+        if (home) {
+            if (chdir(home->c_str()) != 0) {
+                perror("cd");
+                return 1;
+            }
+        }
+    } else if (args.size() == 2) {
+        string path = args[1];
+        if (path == "-") {
+            const string *oldpwd = shell_vars.get("OLDPWD");
+            if (oldpwd) {
+                cout << *oldpwd << endl;
+                if (chdir(oldpwd->c_str()) != 0) {
+                    perror("cd");
+                    return 1;
+                }
+            } else {
+                cerr << "cd: OLDPWD not set" << endl;
+                return 1;
+            }
+        } else {
+            char cwd[1024];
+            if (getcwd(cwd, sizeof(cwd))) {
+                shell_vars.set("OLDPWD", cwd);
+                if (chdir(path.c_str()) != 0) {
+                    perror("cd");
+                    return 1;
+                }
+            }
+        }
+    } else {
+        cerr << "cd: too many arguments" << endl;
+        return 1;
+    }
+    refresh_prompt_cwd();
+    return 0;
+}
+
+int handle_help(const vector<string> &args) {
+    cout << "Enhanced C++ Shell" << endl;
+    cout << "Built-in commands:" << endl;
+    cout << "  cd [dir]       - Change directory (use '-' for previous directory)" << endl;
+    cout << "  help           - Show this help message" << endl;
+    cout << "  history [n]    - Show command history (last n commands)" << endl;
+    cout << "  history -s str - Search history for str (-p: match a prefix, Ctrl-R: recall)" << endl;
+    cout << "  pwd            - Print working directory" << endl;
+    cout << "  ls [options]   - List directory contents (-a: show hidden, -l: long format, -R: recursive)" << endl;
+    cout << "  alias [name=value] - Create or list command aliases" << endl;
+    cout << "  unalias NAME... - Remove aliases" << endl;
+    cout << "  hash [-r] [name...] - List, clear or add remembered command paths" << endl;
+    cout << "  pipeconf [size N|default] [cpus spread|LIST|off] [stats on|off] - Tune pipelines" << endl;
+    cout << "  time pipeline  - Report wall clock, CPU, max RSS and context switches per stage" << endl;
+    cout << "  timing [on|off] [log FILE|off] - Time every pipeline, log JSON records" << endl;
+    cout << "  trace [on|off|reset|export FILE] - Show or export shell latency histograms" << endl;
+    cout << "  prompt [format] - Show or set the prompt (\\u \\h \\w \\W \\$ \\e \\n, or 'default')" << endl;
+    cout << "  jobs, fg [%n], bg [%n], wait [%n|pid] - Manage background jobs" << endl;
+    cout << "  jobout [raw|prefix|group] - How output of background and parallel jobs is shown" << endl;
+    cout << "  export [NAME[=value]...], unset NAME... - Set, export or remove variables" << endl;
+    cout << "  break [N], continue [N], return [N] - Loop and function control" << endl;
+    cout << "  echo [-neE], printf FORMAT [ARG...], test EXPR, [ EXPR ], true, false" << endl;
+    cout << "  exit           - Exit the shell" << endl;
+    cout << "Features:" << endl;
+    cout << "  I/O redirection: <, >, >>, N>, N>&M, &>, <<< word, << DELIM" << endl;
+    cout << "  Piping: command1 | command2" << endl;
+    cout << "  Variables: NAME=value, $NAME, ${NAME}, $?, $$ (FOO=1 cmd sets it for cmd only)" << endl;
+    cout << "  Command substitution: $(command) or `command`" << endl;
+    cout << "  Scripting: if/elif/else/fi, while/until ... do ... done, for x in ...; do ... done," << endl;
+    cout << "             name() { ...; } functions with $1..$9, $#, $@" << endl;
+    cout << "  Lists: cmd1 && cmd2 || cmd3; cmd4 (also across lines)" << endl;
+    cout << "  Parallel jobs: parallel [-j N] { cmd1; cmd2; ... } (output kept per job)" << endl;
+    cout << "  Wildcards: *, ?, [abc], [a-z], [!x] (also across directories: src/*/*.cpp)" << endl;
+    cout << "  Tab completion for commands (builtins, functions, aliases, PATH), files and $variables" << endl;
+    cout << "  Command history with up/down arrows" << endl;
+    cout << "  Background execution with &" << endl;
+    cout << "  Startup file: ~/.liteshellrc (cached in ~/.liteshellrc.snapshot)" << endl;
+    return 0;
+}
+
+int handle_exit(const vector<string> &args) {
+    int code = last_status;
+    if (args.size() > 1) {
+        try {
+            code = stoi(args[1]);
+        } catch (const exception&) {
+            cerr << "exit: " << args[1] << ": numeric argument required" << endl;
+            code = 2;
+        }
+    }
+
+    if (!interactive) {
+        cout.flush();
+        exit(code & 0xff);
+    }
+
+    cout << "Goodbye!" << endl;
+    save_aliases();
+    save_rc_snapshot();
+    cleanup_terminal();
+    exit(code & 0xff);
+}
+
+// Only builtins need owning strings; external commands exec the views
+vector<string> materialize(const vector<string_view> &args) {
+    return vector<string>(args.begin(), args.end());
+}
+
+// Output channel for builtins whose stdout is a pipe or file. Output is
+// collected in one small buffer that lives as long as the process and goes
+// out with a single write when the builtin returns, instead of a write on
+// every endl. Output that outgrows the buffer and is headed into a pipe
+// continues in large page-aligned blocks sent with vmsplice, which lends the
+// pages to the pipe instead of copying them; such a block must not be
+// written again, so it is unmapped after each flush.
+class BuiltinOutput : public streambuf {
+public:
+    static const size_t BUFFER_SIZE = 64 * 1024;
+    static const size_t BLOCK_SIZE = 256 * 1024;
+    static const size_t MAX_BLOCKS = 8;
+
+    explicit BuiltinOutput(int fd) : fd(fd), checked(false), failed(false) {
+        setp(buffer, buffer + BUFFER_SIZE);
+    }
+    BuiltinOutput(const BuiltinOutput&) = delete;
+    BuiltinOutput &operator=(const BuiltinOutput&) = delete;
+
+    // Write out everything collected so far and get ready for the next
+    // builtin, whose stdout may be a different file
+    bool finish() {
+        bool ok = pbase() == buffer ? write_buffer() : flush_blocks();
+        ok = ok && !failed;
+        setp(buffer, buffer + BUFFER_SIZE);
+        checked = false;
+        failed = false;
+        return ok;
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (failed) {
+            return traits_type::eof();
+        }
+        if (pbase() == buffer) {
+            if (!write_buffer()) {
+                return traits_type::eof();
+            }
+            if (!checked) {
+                struct stat st;
+                is_pipe = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+                checked = true;
+            }
+            if (!is_pipe) {
+                setp(buffer, buffer + BUFFER_SIZE);
+                return put_back(c);
+            }
+        } else if (blocks.size() >= MAX_BLOCKS && !flush_blocks()) {
+            return traits_type::eof();
+        }
+        void *block = mmap(nullptr, BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            failed = true;
+            return traits_type::eof();
+        }
+        blocks.push_back(static_cast<char*>(block));
+        setp(blocks.back(), blocks.back() + BLOCK_SIZE);
+        return put_back(c);
+    }
+
+    // endl and flush() only mark a line end; the data goes out in finish()
+    int sync() override { return 0; }
+
+private:
+    int_type put_back(int_type c) {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    bool write_buffer() {
+        const char *data = buffer;
+        size_t left = pptr() - buffer;
+        while (!failed && left > 0) {
+            ssize_t n = write(fd, data, left);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                failed = true;
+                break;
+            }
+            data += n;
+            left -= n;
+        }
+        setp(nullptr, nullptr);
+        return !failed;
+    }
+
+    bool flush_blocks() {
+        if (blocks.empty()) {
+            return !failed;
+        }
+        vector<iovec> iov(blocks.size());
+        for (size_t i = 0; i < blocks.size(); i++) {
+            iov[i].iov_base = blocks[i];
+            iov[i].iov_len = i + 1 < blocks.size() ? BLOCK_SIZE : pptr() - blocks[i];
+        }
+
+        size_t first = 0;
+        if (is_pipe) {
+            // The pipe holds less than a block at once, so make room for
+            // the whole batch where the limit allows
+            size_t total = (blocks.size() - 1) * BLOCK_SIZE + iov.back().iov_len;
+            if (static_cast<size_t>(fcntl(fd, F_GETPIPE_SZ)) < total) {
+                fcntl(fd, F_SETPIPE_SZ, static_cast<int>(total));
+            }
+        }
+        while (!failed && first < iov.size()) {
+            ssize_t n = is_pipe ? vmsplice(fd, &iov[first], iov.size() - first, 0)
+                                : writev(fd, &iov[first], min(iov.size() - first, size_t(IOV_MAX)));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (is_pipe && errno == EINVAL) {
+                    // Not a pipe vmsplice accepts; fall back to copying
+                    is_pipe = false;
+                    continue;
+                }
+                failed = true;
+                break;
+            }
+            while (n > 0 && first < iov.size()) {
+                size_t used = min(static_cast<size_t>(n), iov[first].iov_len);
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + used;
+                iov[first].iov_len -= used;
+                n -= used;
+                if (iov[first].iov_len == 0) first++;
+            }
+            while (first < iov.size() && iov[first].iov_len == 0) first++;
+        }
+
+        for (char *block : blocks) {
+            munmap(block, BLOCK_SIZE);
+        }
+        blocks.clear();
+        setp(nullptr, nullptr);
+        return !failed;
+    }
+
+    int fd;
+    bool is_pipe;
+    bool checked;   // is_pipe is known for the current builtin
+    bool failed;
+    char buffer[BUFFER_SIZE];
+    vector<char*> blocks;
+};
+
+static BuiltinOutput builtin_output(STDOUT_FILENO);
+
+// Call a builtin, sending its cout output through builtin_output unless
+// stdout is a terminal, where output must appear as it is produced
+static int call_builtin(const Builtin *builtin, const vector<string_view> &args) {
+    if (isatty(STDOUT_FILENO) || cout.rdbuf() == &builtin_output) {
+        return builtin->handler(materialize(args));
+    }
+    cout.flush();
+    streambuf *saved = cout.rdbuf(&builtin_output);
+    int status = builtin->handler(materialize(args));
+    builtin_output.finish();
+    cout.rdbuf(saved);
+    return status;
+}
+
+// Apply fd actions in a forked child; nothing needs restoring
+static bool apply_fd_actions(const FdActions &fds) {
+    for (const auto &fd : fds) {
+        if (fd.source == -1) {
+            close(fd.target);
+        } else if (fd.source != fd.target && dup2(fd.source, fd.target) < 0) {
+            cerr << "liteshell: " << fd.source << ": " << strerror(errno) << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Run code inside the shell with fd actions applied temporarily. Each
+// descriptor touched is saved with dup first and restored afterwards, so no
+// process is launched.
+static int with_fd_actions(const FdActions &fds, const function<int()> &run) {
+    vector<FdAction> saved;     // target and its saved copy, -1 if it was closed
+
+    cout.flush();
+    cerr.flush();
+    bool ok = true;
+    for (const auto &fd : fds) {
+        bool seen = false;
+        for (const auto &entry : saved) {
+            seen |= entry.target == fd.target;
+        }
+        if (!seen) {
+            saved.push_back({fd.target, fcntl(fd.target, F_DUPFD_CLOEXEC, 10)});
+        }
+        if (fd.source == -1) {
+            close(fd.target);
+        } else if (fd.source != fd.target && dup2(fd.source, fd.target) < 0) {
+            cerr << "liteshell: " << fd.source << ": " << strerror(errno) << endl;
+            ok = false;
+            break;
+        }
+    }
+
+    int status = ok ? run() : 1;
+
+    cout.flush();
+    cerr.flush();
+    // A write into a pipe whose reader has exited leaves the stream failed
+    cout.clear();
+    cerr.clear();
+    for (const auto &entry : saved) {
+        if (entry.source == -1) {
+            close(entry.target);
+        } else {
+            dup2(entry.source, entry.target);
+            close(entry.source);
+        }
+    }
+    return status;
+}
+
+int run_builtin_redirected(const Builtin *builtin, const vector<string_view> &args,
+                           const FdActions &fds) {
+    return with_fd_actions(fds, [&] { return call_builtin(builtin, args); });
+}
+
+static int exit_code(int status) {
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+// Job control -------------------------------------------------------------
+
+static double timeval_seconds(const struct timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static string json_string(string_view text) {
+    string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + '"';
+}
+
+// Print a timed job's usage to stderr, one line per stage after the totals,
+// and append a JSON record to the timing log if one is open
+static void report_usage(const string &command, int status, double real,
+                         const vector<StageUsage> &stages, bool print) {
+    double user = 0, sys = 0;
+    for (const auto &stage : stages) {
+        user += timeval_seconds(stage.usage.ru_utime);
+        sys += timeval_seconds(stage.usage.ru_stime);
+    }
+
+    if (print) {
+        char line[256];
+        snprintf(line, sizeof(line), "real %.3fs  user %.3fs  sys %.3fs\n", real, user, sys);
+        string out = line;
+        for (size_t i = 0; stages.size() > 1 && i < stages.size(); i++) {
+            const StageUsage &stage = stages[i];
+            snprintf(line, sizeof(line),
+                     "  %zu %-12s real %.3fs  user %.3fs  sys %.3fs  maxrss %ldk  ctxsw %ld/%ld\n",
+                     i + 1, stage.name.c_str(), stage.real,
+                     timeval_seconds(stage.usage.ru_utime), timeval_seconds(stage.usage.ru_stime),
+                     stage.usage.ru_maxrss, stage.usage.ru_nvcsw, stage.usage.ru_nivcsw);
+            out += line;
+        }
+        if (stages.size() == 1) {
+            snprintf(line, sizeof(line), "maxrss %ldk  ctxsw %ld/%ld\n", stages[0].usage.ru_maxrss,
+                     stages[0].usage.ru_nvcsw, stages[0].usage.ru_nivcsw);
+            out += line;
+        }
+        cerr << out;
+    }
+
+    if (timing_log_fd == -1) {
+        return;
+    }
+    char num[160];
+    snprintf(num, sizeof(num), "{\"time\":%ld,\"status\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,",
+             static_cast<long>(time(nullptr)), status, real, user, sys);
+    string record = num;
+    record += "\"command\":" + json_string(command) + ",\"stages\":[";
+    for (size_t i = 0; i < stages.size(); i++) {
+        const StageUsage &stage = stages[i];
+        snprintf(num, sizeof(num),
+                 "%s{\"pid\":%d,\"status\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+                 "\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,\"name\":",
+                 i ? "," : "", static_cast<int>(stage.pid), stage.status, stage.real,
+                 timeval_seconds(stage.usage.ru_utime), timeval_seconds(stage.usage.ru_stime),
+                 stage.usage.ru_maxrss, stage.usage.ru_nvcsw, stage.usage.ru_nivcsw);
+        record += num + json_string(stage.name) + "}";
+    }
+    record += "]}\n";
+    // One write with O_APPEND keeps records from concurrent shells whole
+    if (write(timing_log_fd, record.data(), record.size()) < 0) {
+        perror("timing log");
+    }
+}
+
+static void report_usage(const Job &job, bool print) {
+    if (!job.timed) return;
+    double real = chrono::duration<double>(chrono::steady_clock::now() - job.started).count();
+    report_usage(job.command, job.status, real, job.stages, print);
+}
+
+// getrusage(RUSAGE_THREAD) difference, for stages run inside the shell
+static struct rusage usage_since(const struct rusage &before) {
+    struct rusage after;
+    getrusage(RUSAGE_THREAD, &after);
+    auto sub = [](const timeval &a, const timeval &b) {
+        timeval d;
+        timersub(&a, &b, &d);
+        return d;
+    };
+    after.ru_utime = sub(after.ru_utime, before.ru_utime);
+    after.ru_stime = sub(after.ru_stime, before.ru_stime);
+    after.ru_nvcsw -= before.ru_nvcsw;
+    after.ru_nivcsw -= before.ru_nivcsw;
+    return after;
+}
+
+// timing [on|off] [log FILE|off]
+int handle_timing(const vector<string> &args) {
+    if (args.size() == 1) {
+        cout << "timing " << (timing_all ? "on" : "off") << '\n'
+             << "log    " << (timing_log_fd != -1 ? timing_log_path : "off") << endl;
+        return 0;
+    }
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i] == "on" || args[i] == "off") {
+            timing_all = args[i] == "on";
+        } else if (args[i] == "log" && i + 1 < args.size()) {
+            const string &path = args[++i];
+            if (timing_log_fd != -1) {
+                close(timing_log_fd);
+                timing_log_fd = -1;
+            }
+            if (path == "off") continue;
+            timing_log_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (timing_log_fd < 0) {
+                perror(path.c_str());
+                return 1;
+            }
+            timing_log_path = path;
+        } else {
+            cerr << "timing: usage: timing [on|off] [log FILE|off]" << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static bool write_all(int fd, string_view data) {
+    while (!data.empty()) {
+        ssize_t n = write(fd, data.data(), data.size());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data.remove_prefix(n);
+    }
+    return true;
+}
+
+// Output of background and parallel jobs. Each job writes into a pipe whose
+// read end is registered here; one epoll set covers all of them, so output
+// is drained from the main loop and from foreground waits without a thread
+// per job. Writers never block on the terminal: a collected stream is read
+// as soon as it is ready, and grouped output is flushed early once a job
+// holds more than GROUP_LIMIT bytes.
+enum class JobOutput { Raw, Prefix, Group };
+JobOutput job_output = JobOutput::Prefix;
+
+class OutputCollector {
+public:
+    static const size_t LINE_LIMIT = 64 * 1024;     // longest line kept whole
+    static const size_t GROUP_LIMIT = 1024 * 1024;
+    static const size_t READ_LIMIT = 256 * 1024;    // per source per wakeup
+
+    OutputCollector() : epoll_fd(-1), next_id(1) {}
+
+    bool active() const { return !sources.empty(); }
+    int fd() const { return epoll_fd; }
+
+    // Takes ownership of fd, the read end of a job's output pipe. Returns an
+    // id to ask about the stream, or 0 if it could not be watched (fd is
+    // closed then).
+    uint64_t add(int fd, string label) {
+        if (epoll_fd == -1) epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        uint64_t id = next_id++;
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = id;
+        if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("epoll");
+            close(fd);
+            return 0;
+        }
+        sources[id] = {fd, move(label), job_output, {}};
+        return id;
+    }
+
+    // True while the stream has not reached end of file
+    bool is_open(uint64_t id) const { return sources.count(id) != 0; }
+
+    // Reads whatever is ready and appends the text due for display to out
+    void collect(string &out) {
+        if (sources.empty()) return;
+        struct epoll_event events[64];
+        int n = epoll_wait(epoll_fd, events, 64, 0);
+        for (int i = 0; i < n; i++) {
+            auto it = sources.find(events[i].data.u64);
+            if (it == sources.end()) continue;
+            if (!drain(it->second, out)) {
+                emit(it->second, out, true);
+                close(it->second.fd);
+                sources.erase(it);
+            }
+        }
+    }
+
+    // Collects and writes to stdout; returns false if nothing was written
+    bool flush() {
+        string out;
+        collect(out);
+        if (out.empty()) return false;
+        cout.flush();
+        write_all(STDOUT_FILENO, out);
+        return true;
+    }
+
+    // A forked shell must not share the epoll set or keep job pipes open
+    void reset() {
+        for (auto &entry : sources) close(entry.second.fd);
+        sources.clear();
+        if (epoll_fd != -1) close(epoll_fd);
+        epoll_fd = -1;
+    }
+
+private:
+    struct Source {
+        int fd;
+        string label;
+        JobOutput mode;
+        string pending;     // read but not yet shown
+    };
+
+    // Returns false once the writers are gone
+    static bool drain(Source &source, string &out) {
+        char buf[16384];
+        size_t total = 0;
+        while (total < READ_LIMIT) {
+            ssize_t n = read(source.fd, buf, sizeof(buf));
+            if (n > 0) {
+                source.pending.append(buf, n);
+                total += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) break;
+            return false;
+        }
+        emit(source, out, false);
+        return true;
+    }
+
+    // Moves the displayable part of pending to out: whole lines with their
+    // prefix, or in group mode everything once the job ends or grows large
+    static void emit(Source &source, string &out, bool at_eof) {
+        string &pending = source.pending;
+        if (source.mode == JobOutput::Group) {
+            if (!at_eof && pending.size() < GROUP_LIMIT) return;
+            size_t eol = pending.rfind('\n');
+            size_t end = at_eof || eol == string::npos ? pending.size() : eol + 1;
+            out.append(pending, 0, end);
+            if (at_eof && !pending.empty() && pending.back() != '\n') out += '\n';
+            pending.erase(0, end);
+            return;
+        }
+
+        size_t start = 0;
+        while (start < pending.size()) {
+            size_t eol = pending.find('\n', start);
+            if (eol == string::npos) {
+                if (!at_eof && pending.size() - start < LINE_LIMIT) break;
+                eol = pending.size();
+            }
+            out += source.label;
+            out.append(pending, start, eol - start);
+            out += '\n';
+            start = eol + 1;
+        }
+        pending.erase(0, min(start, pending.size()));
+    }
+
+    int epoll_fd;
+    uint64_t next_id;
+    unordered_map<uint64_t, Source> sources;
+};
+
+OutputCollector output_collector;
+
+// Background jobs are collected only in an interactive shell; a script may
+// exit before its jobs finish writing
+static bool collect_background() {
+    return interactive && job_output != JobOutput::Raw;
+}
+
+static int next_job_id() {
+    return jobs.empty() ? 1 : jobs.rbegin()->first + 1;
+}
+
+// export [NAME[=value]...]; without names, lists the exported variables
+int handle_export(const vector<string> &args) {
+    if (args.size() == 1) {
+        vector<string> names;
+        for (const auto &entry : shell_vars.all()) {
+            if (entry.second.exported) names.push_back(entry.first);
+        }
+        sort(names.begin(), names.end());
+        for (const auto &name : names) {
+            cout << "export " << name << "=\"";
+            for (char c : *shell_vars.get(name)) {
+                if (strchr("\"\\$`", c)) cout << '\\';
+                cout << c;
+            }
+            cout << "\"\n";
+        }
+        cout.flush();
+        return 0;
+    }
+    int status = 0;
+    for (size_t i = 1; i < args.size(); i++) {
+        size_t eq = args[i].find('=');
+        string name = args[i].substr(0, eq);
+        if (!valid_name(name)) {
+            cerr << "export: '" << args[i] << "': not a valid identifier" << endl;
+            status = 1;
+        } else if (eq == string::npos) {
+            shell_vars.export_name(name);
+        } else {
+            shell_vars.set(name, args[i].substr(eq + 1), true);
+        }
+    }
+    return status;
+}
+
+int handle_unset(const vector<string> &args) {
+    for (size_t i = 1; i < args.size(); i++) {
+        shell_vars.unset(args[i]);
+    }
+    return 0;
+}
+
+// jobout [raw|prefix|group]
+int handle_jobout(const vector<string> &args) {
+    static const char *names[] = {"raw", "prefix", "group"};
+    if (args.size() == 1) {
+        cout << names[static_cast<int>(job_output)] << endl;
+        return 0;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (args.size() == 2 && args[1] == names[i]) {
+            job_output = static_cast<JobOutput>(i);
+            return 0;
+        }
+    }
+    cerr << "jobout: usage: jobout [raw|prefix|group]" << endl;
+    return 1;
+}
+
+// Every mode waits for children through the SIGCHLD pipe, so it is set up
+// before anything, the rc included, can start one
+void init_sigchld() {
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror("pipe");
+    }
+    struct sigaction sa = {};
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, nullptr);
+}
+
+void init_job_control() {
+    if (interactive) {
+        // Put the shell in its own group and take the terminal; the shell
+        // itself must not be stopped by terminal access
+        signal(SIGTTOU, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        shell_pgid = getpid();
+        setpgid(shell_pgid, shell_pgid);
+        job_control = tcsetpgrp(STDIN_FILENO, shell_pgid) == 0;
+    }
+}
+
+// Apply one wait4 result to the job that owns pid
+static void update_job(Job &job, pid_t pid, int status, const struct rusage &usage) {
+    if (WIFSTOPPED(status)) {
+        job.state = JobState::Stopped;
+        return;
+    }
+    if (WIFCONTINUED(status)) {
+        job.state = JobState::Running;
+        return;
+    }
+    job.pids.erase(remove(job.pids.begin(), job.pids.end(), pid), job.pids.end());
+    for (auto &stage : job.stages) {
+        if (stage.pid == pid) {
+            stage.status = exit_code(status);
+            stage.usage = usage;
+            stage.real = chrono::duration<double>(chrono::steady_clock::now() - job.started).count();
+        }
+    }
+    if (pid == job.last_pid) {
+        job.status = exit_code(status);
+    }
+    if (job.pids.empty()) {
+        job.state = JobState::Done;
+    }
+}
+
+// Collect status changes of background jobs without blocking
+void reap_jobs() {
+    char buf[64];
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+
+    for (auto &entry : jobs) {
+        Job &job = entry.second;
+        vector<pid_t> pids = job.pids;
+        for (pid_t pid : pids) {
+            int status;
+            struct rusage usage;
+            if (wait4(pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage) == pid) {
+                update_job(job, pid, status, usage);
+            }
+        }
+    }
+}
+
+static const char *job_state_name(JobState state) {
+    switch (state) {
+    case JobState::Running: return "Running";
+    case JobState::Stopped: return "Stopped";
+    default: return "Done";
+    }
+}
+
+static void print_job(const Job &job) {
+    bool current = !jobs.empty() && jobs.rbegin()->first == job.id;
+    cout << "[" << job.id << "]" << (current ? "+ " : "  ")
+         << job_state_name(job.state) << "\t\t" << job.command << endl;
+}
+
+// Report and forget finished jobs; called before each prompt
+void notify_jobs() {
+    if (sigchld_pipe[0] == -1) return;
+    reap_jobs();
+    for (auto it = jobs.begin(); it != jobs.end(); ) {
+        if (it->second.state == JobState::Done) {
+            if (interactive) print_job(it->second);
+            report_usage(it->second, false);
+            it = jobs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Wait for a foreground job to finish or stop, lending it the terminal.
+// A stopped job stays in the table; a finished one is removed.
+int wait_for_job(int id) {
+    Job &job = jobs[id];
+    if (job_control && job.pgid > 0) {
+        tcsetpgrp(STDIN_FILENO, job.pgid);
+    }
+
+    while (!job.pids.empty() && job.state != JobState::Stopped) {
+        int status;
+        struct rusage usage;
+        int flags = WUNTRACED;
+        if (output_collector.active()) {
+            // Keep background output flowing while this job runs
+            char buf[64];
+            while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+            }
+            flags |= WNOHANG;
+        }
+        pid_t pid = wait4(job.pids.front(), &status, flags, &usage);
+        if (pid == 0) {
+            struct pollfd fds[2] = {
+                {sigchld_pipe[0], POLLIN, 0},
+                {output_collector.fd(), POLLIN, 0},
+            };
+            poll(fds, 2, -1);
+            output_collector.flush();
+            continue;
+        }
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            job.pids.erase(job.pids.begin());
+            continue;
+        }
+        update_job(job, pid, status, usage);
+    }
+
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &original_termios);
+    }
+
+    int status = job.status;
+    if (interactive && status == 128 + SIGINT) {
+        cout << endl;
+    }
+    if (job.state == JobState::Stopped) {
+        cout << endl;
+        print_job(job);
+        status = 128 + SIGTSTP;
+    } else {
+        report_usage(job, true);
+        jobs.erase(id);
+    }
+    return status;
+}
+
+// Add a launched job; background jobs are announced and left running,
+// foreground jobs are waited for. stages is given for timed jobs.
+int start_job(pid_t pgid, const vector<pid_t> &pids, const string &text, bool background,
+              vector<StageUsage> *stages = nullptr,
+              chrono::steady_clock::time_point started = {}) {
+    if (pids.empty()) {
+        return 127;
+    }
+
+    int id = next_job_id();
+    Job &job = jobs[id];
+    job.id = id;
+    job.pgid = pgid;
+    job.pids = pids;
+    job.last_pid = pids.back();
+    job.status = 0;
+    job.state = JobState::Running;
+    job.command = text;
+    if (stages) {
+        job.timed = true;
+        job.started = started;
+        job.stages = move(*stages);
+    }
+
+    if (background) {
+        job.command += " &";
+        cout << "[" << id << "] " << pgid << endl;
+        return 0;
+    }
+    return wait_for_job(id);
+}
+
+// Parse a job spec ("%n", "n" or nothing for the current job)
+static Job *find_job(const vector<string> &args, const char *name) {
+    if (jobs.empty()) {
+        cerr << name << ": no current job" << endl;
+        return nullptr;
+    }
+    if (args.size() < 2) {
+        return &jobs.rbegin()->second;
+    }
+
+    string spec = args[1];
+    if (!spec.empty() && spec[0] == '%') spec.erase(0, 1);
+    try {
+        auto it = jobs.find(stoi(spec));
+        if (it != jobs.end()) return &it->second;
+    } catch (const exception&) {
+    }
+    cerr << name << ": " << args[1] << ": no such job" << endl;
+    return nullptr;
+}
+
+int handle_jobs(const vector<string> &args) {
+    reap_jobs();
+    for (auto it = jobs.begin(); it != jobs.end(); ) {
+        print_job(it->second);
+        if (it->second.state == JobState::Done) {
+            report_usage(it->second, false);
+            it = jobs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return 0;
+}
+
+int handle_fg(const vector<string> &args) {
+    Job *job = find_job(args, "fg");
+    if (!job) return 1;
+
+    if (job->command.size() > 2 && job->command.compare(job->command.size() - 2, 2, " &") == 0) {
+        job->command.erase(job->command.size() - 2);
+    }
+    cout << job->command << endl;
+    job->state = JobState::Running;
+    if (job->pgid > 0) {
+        kill(-job->pgid, SIGCONT);
+    }
+    return wait_for_job(job->id);
+}
+
+int handle_bg(const vector<string> &args) {
+    Job *job = find_job(args, "bg");
+    if (!job) return 1;
+
+    if (job->state == JobState::Stopped) {
+        if (job->command.size() < 2 || job->command.compare(job->command.size() - 2, 2, " &") != 0) {
+            job->command += " &";
+        }
+        job->state = JobState::Running;
+        kill(-job->pgid, SIGCONT);
+    }
+    cout << "[" << job->id << "] " << job->command << endl;
+    return 0;
+}
+
+// wait [%n|pid]: block until the given job, or every job, has finished
+int handle_wait(const vector<string> &args) {
+    vector<int> ids;
+    if (args.size() < 2) {
+        for (const auto &entry : jobs) ids.push_back(entry.first);
+    } else {
+        string spec = args[1];
+        if (spec[0] != '%') {
+            // A pid selects the job that contains it
+            for (const auto &entry : jobs) {
+                const vector<pid_t> &pids = entry.second.pids;
+                if (to_string(entry.second.pgid) == spec ||
+                    find_if(pids.begin(), pids.end(), [&](pid_t p) { return to_string(p) == spec; }) != pids.end()) {
+                    ids.push_back(entry.first);
+                }
+            }
+        }
+        if (ids.empty()) {
+            Job *job = find_job(args, "wait");
+            if (!job) return 127;
+            ids.push_back(job->id);
+        }
+    }
+
+    int status = 0;
+    for (int id : ids) {
+        Job &job = jobs[id];
+        while (!job.pids.empty()) {
+            int child_status;
+            struct rusage usage;
+            pid_t pid = wait4(job.pids.front(), &child_status, 0, &usage);
+            if (pid < 0) {
+                if (errno == EINTR) continue;
+                job.pids.erase(job.pids.begin());
+                continue;
+            }
+            update_job(job, pid, child_status, usage);
+        }
+        status = job.status;
+        report_usage(job, false);
+        jobs.erase(id);
+    }
+    return status;
+}
+
+// Pipeline tuning ---------------------------------------------------------
+
+// Settings applied to every foreground and background pipeline, changed
+// with the pipeconf builtin
+struct PipeConfig {
+    int pipe_size = 0;          // F_SETPIPE_SZ for each pipe, 0 keeps the default
+    bool spread = false;        // pin stage i to the i-th CPU the shell may use
+    vector<int> cpus;           // or cycle stages through these CPUs
+    bool stats = false;         // relay pipes through the shell and report bytes/s
+};
+PipeConfig pipe_config;
+
+// Byte count of one relayed pipe, filled in by its relay thread
+struct RelayStats {
+    uint64_t bytes = 0;
+    double seconds = 0;
+};
+
+// Move data from one pipe to another with splice, counting it. The pages
+// are moved between the pipes, so the relay costs no copy.
+static void relay_pipe(int from, int to, shared_ptr<RelayStats> stats) {
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+    auto start = chrono::steady_clock::now();
+    while (true) {
+        ssize_t n = splice(from, nullptr, to, nullptr, 1 << 20, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        stats->bytes += n;
+    }
+    stats->seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    close(from);
+    close(to);
+}
+
+// Report each relayed pipe once its job has finished. A stopped job's pipes
+// stay open, so then the relays are left to finish on their own.
+static void finish_relays(vector<thread> &relays, const vector<shared_ptr<RelayStats>> &stats,
+                          bool stopped) {
+    for (auto &worker : relays) {
+        if (stopped) {
+            worker.detach();
+        } else {
+            worker.join();
+        }
+    }
+    if (stopped) return;
+
+    for (size_t i = 0; i < stats.size(); i++) {
+        const RelayStats &pipe = *stats[i];
+        double rate = pipe.seconds > 0 ? pipe.bytes / pipe.seconds / 1e6 : 0;
+        char line[128];
+        snprintf(line, sizeof(line), "pipe %zu (stage %zu -> %zu): %llu bytes in %.3f s, %.1f MB/s\n",
+                 i + 1, i + 1, i + 2, static_cast<unsigned long long>(pipe.bytes), pipe.seconds, rate);
+        cerr << line;
+    }
+}
+
+// The CPU for each stage, or an empty list when stages are not pinned
+static vector<int> stage_cpus(int num_stages) {
+    vector<int> pool = pipe_config.cpus;
+    if (pipe_config.spread) {
+        cpu_set_t mask;
+        if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &mask)) pool.push_back(cpu);
+            }
+        }
+    }
+    vector<int> result;
+    if (!pool.empty()) {
+        for (int i = 0; i < num_stages; i++) {
+            result.push_back(pool[i % pool.size()]);
+        }
+    }
+    return result;
+}
+
+static void pin_to_cpu(int cpu) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    sched_setaffinity(0, sizeof(mask), &mask);
+}
+
+// Parse a size such as 1048576, 256k or 1m
+static bool parse_size(const string &text, int &size) {
+    size_t end;
+    long long value;
+    try {
+        value = stoll(text, &end);
+    } catch (const exception&) {
+        return false;
+    }
+    string suffix = text.substr(end);
+    if (suffix == "k" || suffix == "K") value <<= 10;
+    else if (suffix == "m" || suffix == "M") value <<= 20;
+    else if (!suffix.empty()) return false;
+    if (value < 0 || value > INT_MAX) return false;
+    size = static_cast<int>(value);
+    return true;
+}
+
+// Parse a CPU list such as 0,2-3
+static bool parse_cpu_list(const string &text, vector<int> &cpus) {
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t comma = text.find(',', pos);
+        string item = text.substr(pos, comma == string::npos ? string::npos : comma - pos);
+        size_t dash = item.find('-');
+        try {
+            int first = stoi(item.substr(0, dash));
+            int last = dash == string::npos ? first : stoi(item.substr(dash + 1));
+            if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+            for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        } catch (const exception&) {
+            return false;
+        }
+        if (comma == string::npos) break;
+        pos = comma + 1;
+    }
+    return !cpus.empty();
+}
+
+// pipeconf [size N[k|m]|default] [cpus spread|LIST|off] [stats on|off]
+int handle_pipeconf(const vector<string> &args) {
+    if (args.size() == 1) {
+        cout << "size  " << (pipe_config.pipe_size ? to_string(pipe_config.pipe_size) : "default") << '\n';
+        cout << "cpus  ";
+        if (pipe_config.spread) {
+            cout << "spread";
+        } else if (pipe_config.cpus.empty()) {
+            cout << "off";
+        } else {
+            for (size_t i = 0; i < pipe_config.cpus.size(); i++) {
+                cout << (i ? "," : "") << pipe_config.cpus[i];
+            }
+        }
+        cout << '\n' << "stats " << (pipe_config.stats ? "on" : "off") << endl;
+        return 0;
+    }
+
+    PipeConfig config = pipe_config;
+    for (size_t i = 1; i < args.size(); i += 2) {
+        const string &key = args[i];
+        if (i + 1 >= args.size()) {
+            cerr << "pipeconf: " << key << ": value required" << endl;
+            return 1;
+        }
+        const string &value = args[i + 1];
+        if (key == "size") {
+            int size = 0;
+            if (value != "default" && !parse_size(value, size)) {
+                cerr << "pipeconf: " << value << ": invalid size" << endl;
+                return 1;
+            }
+            if (size > 0) {
+                // Check against the kernel's limit now rather than per pipe
+                int fds[2];
+                if (pipe2(fds, O_CLOEXEC) == 0) {
+                    int result = fcntl(fds[1], F_SETPIPE_SZ, size);
+                    int err = errno;
+                    close(fds[0]);
+                    close(fds[1]);
+                    if (result < 0) {
+                        cerr << "pipeconf: size " << value << ": " << strerror(err) << endl;
+                        return 1;
+                    }
+                }
+            }
+            config.pipe_size = size;
+        } else if (key == "cpus") {
+            config.spread = value == "spread";
+            config.cpus.clear();
+            if (value != "spread" && value != "off" && !parse_cpu_list(value, config.cpus)) {
+                cerr << "pipeconf: " << value << ": invalid CPU list" << endl;
+                return 1;
+            }
+        } else if (key == "stats") {
+            if (value != "on" && value != "off") {
+                cerr << "pipeconf: stats: expected on or off" << endl;
+                return 1;
+            }
+            config.stats = value == "on";
+        } else {
+            cerr << "pipeconf: " << key << ": unknown setting" << endl;
+            return 1;
+        }
+    }
+    pipe_config = config;
+    return 0;
+}
+
+// Run a pipeline and return the exit status of its last stage. One builtin
+// stage, the last if possible or else the first, runs inside the shell after
+// the other stages have been launched; other builtin stages are forked.
+// Each stage gets its pipe ends first and then its own fd actions.
+// Background pipelines are registered as jobs and not waited for.
+int execute_pipeline(const vector<vector<string_view>> &commands, const vector<FdActions> &stage_fds,
+                     bool background, const string &text, bool timed,
+                     const vector<char*const*> *stage_envp) {
+    if (commands.empty()) return 0;
+
+    int num_commands = commands.size();
+    vector<const Builtin*> stage_builtins(num_commands);
+    for (int i = 0; i < num_commands; i++) {
+        stage_builtins[i] = find_builtin(commands[i][0]);
+    }
+
+    int in_process = -1;
+    if (background) {
+        // Everything runs in children so the prompt comes straight back
+    } else if (stage_builtins.back() && stage_builtins.back()->in_process_stage) {
+        in_process = num_commands - 1;
+    } else if (stage_builtins[0] && stage_builtins[0]->in_process_stage) {
+        in_process = 0;
+    }
+
+    auto started = chrono::steady_clock::now();
+    vector<StageUsage> usage;
+    if (timed) {
+        usage.resize(num_commands);
+        for (int i = 0; i < num_commands; i++) {
+            usage[i].name = string(commands[i][0]);
+        }
+    }
+    struct rusage self_before;
+    auto run_in_process = [&](int i, const FdActions &fds) {
+        TraceScope trace(TracePhase::Builtin);
+        if (timed) getrusage(RUSAGE_THREAD, &self_before);
+        int status = run_builtin_redirected(stage_builtins[i], commands[i], fds);
+        if (timed) {
+            usage[i].usage = usage_since(self_before);
+            usage[i].status = status;
+            usage[i].real = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        }
+        return status;
+    };
+
+    // Handle single builtin command specially (no pipe or job needed)
+    if (num_commands == 1 && stage_builtins[0] && !background) {
+        int status = run_in_process(0, stage_fds[0]);
+        if (timed) {
+            report_usage(text, status, usage[0].real, usage, true);
+        }
+        return status;
+    }
+
+    // pipes[i] connects stage i to stage i + 1. With stats on, a second
+    // pipe is put in front of stage i + 1 and a relay thread moves the
+    // data across; relay_fds[i] holds the relay's source and sink.
+    bool relay = pipe_config.stats && !background;
+    vector<array<int, 2>> pipes(num_commands - 1);
+    vector<array<int, 2>> relay_fds;
+    auto close_pipes = [&]() {
+        for (auto &p : pipes) {
+            if (p[0] != -1) close(p[0]);
+            if (p[1] != -1) close(p[1]);
+        }
+        for (auto &r : relay_fds) {
+            close(r[0]);
+            close(r[1]);
+        }
+    };
+    for (int i = 0; i < num_commands - 1; i++) {
+        array<int, 2> extra;
+        if (pipe2(pipes[i].data(), O_CLOEXEC) < 0) {
+            perror("pipe");
+            pipes[i] = {-1, -1};
+            close_pipes();
+            return 1;
+        }
+        if (relay) {
+            if (pipe2(extra.data(), O_CLOEXEC) < 0) {
+                perror("pipe");
+                close_pipes();
+                return 1;
+            }
+            relay_fds.push_back({pipes[i][0], extra[1]});
+            pipes[i][0] = extra[0];
+        }
+        if (pipe_config.pipe_size > 0) {
+            fcntl(pipes[i][1], F_SETPIPE_SZ, pipe_config.pipe_size);
+            if (relay) fcntl(extra[1], F_SETPIPE_SZ, pipe_config.pipe_size);
+        }
+    }
+
+    // Stages are pinned by setting the shell's own affinity around each
+    // launch, which the child inherits; the original mask is put back after
+    vector<int> cpus = stage_cpus(num_commands);
+    cpu_set_t shell_mask;
+    if (!cpus.empty()) {
+        sched_getaffinity(0, sizeof(shell_mask), &shell_mask);
+    }
+
+    // A collected background job writes stdout and stderr into one pipe
+    // read by the output collector; redirections still take precedence
+    int output[2] = {-1, -1};
+    if (background && collect_background() && pipe2(output, O_CLOEXEC) < 0) {
+        perror("pipe");
+        output[0] = output[1] = -1;
+    }
+
+    auto fds_for = [&](int i) {
+        FdActions fds;
+        fds.reserve(stage_fds[i].size() + 4);
+        if (output[1] != -1) {
+            fds.push_back({STDOUT_FILENO, output[1]});
+            fds.push_back({STDERR_FILENO, output[1]});
+        }
+        if (i > 0) fds.push_back({STDIN_FILENO, pipes[i - 1][0]});
+        if (i < num_commands - 1) fds.push_back({STDOUT_FILENO, pipes[i][1]});
+        fds.insert(fds.end(), stage_fds[i].begin(), stage_fds[i].end());
+        return fds;
+    };
+
+    // Foreground jobs only get their own group under job control; background
+    // jobs always do so they can be told apart and signalled as a unit
+    bool own_group = job_control || background;
+    pid_t pgid = own_group ? 0 : -1;
+    vector<pid_t> pids;
+    uint64_t spawn_start = tracing ? monotonic_ns() : 0;
+    for (int i = 0; i < num_commands; i++) {
+        if (i == in_process) continue;
+
+        FdActions fds = fds_for(i);
+        bool take_terminal = job_control && !background && pids.empty();
+        if (!cpus.empty()) {
+            pin_to_cpu(cpus[i]);
+        }
+
+        pid_t pid;
+        if (const Builtin *builtin = stage_builtins[i]) {
+            // Builtins have no image to exec, so this stage needs a forked child
+            pid = fork();
+            if (pid == 0) { // Child process
+                in_subshell = true;
+                if (own_group) {
+                    setpgid(0, pgid);
+                    if (take_terminal) tcsetpgrp(STDIN_FILENO, getpgrp());
+                }
+                signal(SIGPIPE, SIG_DFL);
+                signal(SIGTSTP, SIG_DFL);
+                if (!apply_fd_actions(fds)) {
+                    exit(1);
+                }
+                for (auto &p : pipes) {
+                    close(p[0]);
+                    close(p[1]);
+                }
+                for (auto &r : relay_fds) {
+                    close(r[0]);
+                    close(r[1]);
+                }
+                int status = call_builtin(builtin, commands[i]);
+                cout.flush();
+                exit(status);
+            } else if (pid < 0) {
+                perror("fork");
+            } else if (own_group) {
+                setpgid(pid, pgid);
             }
         } else {
-            token += c;
+            pid = spawn_external(commands[i], fds, pgid, take_terminal,
+                                 stage_envp ? (*stage_envp)[i] : nullptr);
+        }
+
+        if (pid > 0) {
+            if (pgid == 0) pgid = pid;
+            pids.push_back(pid);
+            if (timed) usage[i].pid = pid;
+        } else if (i == num_commands - 1) {
+            last_status = 127;
+        }
+
+        // The parent no longer needs this stage's pipe ends
+        if (i > 0) close(pipes[i - 1][0]);
+        if (i < num_commands - 1) close(pipes[i][1]);
+    }
+    if (!cpus.empty()) {
+        sched_setaffinity(0, sizeof(shell_mask), &shell_mask);
+    }
+    trace_since(TracePhase::Spawn, spawn_start);
+    if (output[1] != -1) {
+        close(output[1]);
+        if (pids.empty()) {
+            close(output[0]);
+        } else {
+            output_collector.add(output[0], "[" + to_string(next_job_id()) + "] ");
+        }
+    }
+
+    // Relays start once every child exists, so none of them is forked with
+    // a relay running; each thread owns and closes its two descriptors
+    vector<thread> relays;
+    vector<shared_ptr<RelayStats>> relay_stats;
+    for (auto &r : relay_fds) {
+        relay_stats.push_back(make_shared<RelayStats>());
+        relays.emplace_back(relay_pipe, r[0], r[1], relay_stats.back());
+    }
+    relay_fds.clear();
+
+    int status = 0;
+    if (in_process != -1) {
+        status = run_in_process(in_process, fds_for(in_process));
+        if (in_process > 0) close(pipes[in_process - 1][0]);
+        if (in_process < num_commands - 1) close(pipes[in_process][1]);
+    }
+
+    if (pids.empty()) {
+        for (auto &worker : relays) worker.join();
+        return in_process == num_commands - 1 ? status : 127;
+    }
+
+    uint64_t wait_start = tracing && !background ? monotonic_ns() : 0;
+    int job_status = start_job(own_group ? pgid : -1, pids, text, background,
+                               timed ? &usage : nullptr, started);
+    trace_since(TracePhase::Wait, wait_start);
+    if (!relays.empty()) {
+        finish_relays(relays, relay_stats, job_status == 128 + SIGTSTP);
+    }
+    if (in_process == num_commands - 1) {
+        return status;
+    }
+    if (!background && num_commands == 1) {
+        reset_terminal();
+    }
+    return job_status;
+}
+
+// Returns a readable descriptor holding text, for here-documents and
+// here-strings. Text that fits in a pipe's buffer is written into a pipe;
+// anything larger goes to an anonymous memfd, so no file is ever created.
+static int open_document(string_view text) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == 0) {
+        int capacity = fcntl(fds[1], F_GETPIPE_SZ);
+        if (capacity >= 0 && text.size() <= static_cast<size_t>(capacity)) {
+            bool ok = write_all(fds[1], text);
+            close(fds[1]);
+            if (ok) return fds[0];
+            perror("here-document");
+            close(fds[0]);
+            return -1;
         }
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    int fd = memfd_create("liteshell-document", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (!write_all(fd, text) || lseek(fd, 0, SEEK_SET) < 0) {
+        perror("here-document");
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    if (!token.empty()) {
-        tokens.push_back(token);
+// Turns one redirection into fd actions. Descriptors it opens are added to
+// opened; they are close-on-exec and the caller closes them once the
+// pipeline has started. Returns false after reporting an error.
+static bool add_redirect(const Redirect &redirect, FdActions &actions, vector<int> &opened,
+                         deque<string> &storage) {
+    TokenKind kind = redirect.kind;
+    int fd = -1;
+    switch (kind) {
+    case TokenKind::DLess:
+    case TokenKind::DLessDash:
+        fd = open_document(redirect.body);
+        break;
+    case TokenKind::TLess: {
+        string text = expand_text(redirect.target);
+        text += '\n';
+        fd = open_document(text);
+        break;
+    }
+    case TokenKind::LessAnd:
+    case TokenKind::GreatAnd: {
+        int source;
+        if (redirect.target.text == "-") {
+            actions.push_back({redirect.fd, -1});
+            return true;
+        }
+        if (parse_fd(redirect.target.text, source)) {
+            actions.push_back({redirect.fd, source});
+            return true;
+        }
+        if (kind == TokenKind::LessAnd || redirect.fd != 1) {
+            cerr << redirect.target.text << ": ambiguous redirect" << endl;
+            return false;
+        }
+        // ">&file" is the same as "&>file"
+        kind = TokenKind::AndGreat;
+        break;
+    }
+    default:
+        break;
     }
 
-    vector<string> expanded_tokens;
-    for (const auto &token : tokens) {
-        if (token.find('*') != string::npos) {
-            auto expanded = expand_wildcards(token);
-            expanded_tokens.insert(expanded_tokens.end(), expanded.begin(), expanded.end());
+    if (fd == -1 && !is_heredoc(kind) && kind != TokenKind::TLess) {
+        // File targets are words, so the text is NUL-terminated. A glob is
+        // used only if it matches exactly one file.
+        vector<string_view> names;
+        expand_words({redirect.target}, names, storage);
+        if (names.size() != 1) {
+            cerr << redirect.target.text << ": ambiguous redirect" << endl;
+            return false;
+        }
+
+        int flags = O_WRONLY | O_CREAT;
+        if (kind == TokenKind::Less) {
+            flags = O_RDONLY;
+        } else if (kind == TokenKind::DGreat || kind == TokenKind::AndDGreat) {
+            flags |= O_APPEND;
         } else {
-            expanded_tokens.push_back(token);
+            flags |= O_TRUNC;
         }
+        fd = open(names[0].data(), flags | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            cerr << names[0] << ": " << strerror(errno) << endl;
+            return false;
+        }
+    }
+    if (fd < 0) {
+        return false;
     }
 
-    return expanded_tokens;
+    opened.push_back(fd);
+    if (kind == TokenKind::AndGreat || kind == TokenKind::AndDGreat) {
+        actions.push_back({STDOUT_FILENO, fd});
+        actions.push_back({STDERR_FILENO, fd});
+    } else {
+        actions.push_back({redirect.fd, fd});
+    }
+    return true;
 }
 
-vector<string> expand_wildcards(const string &pattern) {
-    vector<string> matches;
-    string dir_path = ".";
-    string file_pattern = pattern;
-    
-    size_t last_slash = pattern.rfind('/');
-    if (last_slash != string::npos) {
-        dir_path = pattern.substr(0, last_slash);
-        file_pattern = pattern.substr(last_slash + 1);
+// Control flow ----------------------------------------------------------
+
+// A pending break, continue or return. The builtins set it; compiled lists
+// stop running items while it is set, and loops and function calls clear
+// the kinds meant for them.
+enum class Flow { Normal, Break, Continue, Return };
+Flow flow = Flow::Normal;
+int flow_levels = 0;        // loops still to leave for break/continue N
+int loop_depth = 0;
+int function_depth = 0;
+
+// Functions pin the parsed line they were defined on, since their compiled
+// body points into it and the parse cache may drop it. Functions restored
+// from the rc snapshot have only the source of that line until first called.
+struct ShellFunction {
+    shared_ptr<const ParsedCommand> pin;
+    shared_ptr<const Program> body;
+    string source;
+};
+unordered_map<string, ShellFunction> functions;
+shared_ptr<const ParsedCommand> executing_parse;    // the line being run by run_line
+
+// The last definition of name in list, searching inside compound commands
+static const CompoundCommand *find_definition(const CommandList &list, const string &name) {
+    const CompoundCommand *found = nullptr;
+    for (const auto &chain : list.items) {
+        for (const auto &item : chain.items) {
+            if (!item.compound) continue;
+            if (item.compound->kind == CompoundKind::Function && item.compound->name == name) {
+                found = item.compound.get();
+            }
+            for (const auto *lists : {&item.compound->conditions, &item.compound->bodies}) {
+                for (const auto &inner : *lists) {
+                    if (const CompoundCommand *def = find_definition(inner, name)) found = def;
+                }
+            }
+        }
     }
-    
-    DIR *dir = opendir(dir_path.c_str());
-    if (!dir) {
-        matches.push_back(pattern);
-        return matches;
+    return found;
+}
+
+static bool compile_function(ShellFunction &function, const string &name) {
+    auto parsed = parse_cached(function.source);
+    const CompoundCommand *def = nullptr;
+    if (parsed && !parsed->incomplete && !parsed->line.incomplete) {
+        def = find_definition(parsed->list, name);
     }
-    
-    struct dirent *entry;
-    while ((entry = readdir(dir))) {
-        string filename = entry->d_name;
-        
-        if (file_pattern.empty() || file_pattern[0] != '.') {
-            if (filename[0] == '.') continue;
+    if (!def) {
+        cerr << name << ": function definition could not be restored" << endl;
+        return false;
+    }
+    function.pin = parsed;
+    function.body = make_shared<const Program>(compile_list(def->bodies[0]));
+    return true;
+}
+
+static int call_function(ShellFunction &function, const vector<string_view> &args) {
+    if (!function.body && !compile_function(function, string(args[0]))) return 1;
+    // Copied so the function may redefine itself while running
+    ShellFunction running = function;
+    vector<string> saved = move(positional_args);
+    positional_args.assign(args.begin() + 1, args.end());
+    function_depth++;
+    int status = (*running.body)();
+    function_depth--;
+    if (flow == Flow::Return) flow = Flow::Normal;
+    positional_args = move(saved);
+    return status;
+}
+
+// Only commands that define aliases, variables and functions, or call
+// functions that do, leave the rc replayable from its snapshot
+static void note_rc_command(const Pipeline &pipeline, const vector<vector<string_view>> &commands) {
+    static const string_view pure[] = {"alias", "break", "continue", "export", "false",
+                                       "return", "true", "unalias", "unset"};
+    bool replayable = !pipeline.background;
+    for (size_t i = 0; i < commands.size(); i++) {
+        replayable &= pipeline.stages[i].redirects.empty();
+        if (commands[i].empty()) continue;
+        if (commands.size() == 1 && functions.count(string(commands[i][0]))) continue;
+        replayable &= std::find(std::begin(pure), std::end(pure), commands[i][0]) != std::end(pure);
+    }
+    if (!replayable) rc_recording->replayable = false;
+}
+
+int execute_command(const Pipeline &pipeline) {
+    if (pipeline.stages.empty()) {
+        return 0;
+    }
+
+    // Expansion results live only for this run
+    unsigned long substitutions = substitutions_run;
+    deque<string> storage;
+    vector<vector<string_view>> commands;
+    commands.reserve(pipeline.stages.size());
+    {
+        TraceScope trace(TracePhase::Expand);
+        for (const auto &stage : pipeline.stages) {
+            if (!stage.expands) {
+                commands.push_back(stage.argv);
+                continue;
+            }
+            commands.emplace_back();
+            expand_words(stage.words, commands.back(), storage);
         }
-        
-        bool match = true;
-        size_t pattern_pos = 0;
-        size_t name_pos = 0;
-        
-        while (pattern_pos < file_pattern.size() && name_pos < filename.size()) {
-            if (file_pattern[pattern_pos] == '*') {
-                if (pattern_pos == file_pattern.size() - 1) {
-                    name_pos = filename.size();
+    }
+
+    vector<FdActions> stage_fds(pipeline.stages.size());
+    vector<int> opened;
+    bool ok = true;
+    {
+        TraceScope trace(TracePhase::Redirect);
+        for (size_t i = 0; i < pipeline.stages.size() && ok; i++) {
+            for (const auto &redirect : pipeline.stages[i].redirects) {
+                if (!add_redirect(redirect, stage_fds[i], opened, storage)) {
+                    ok = false;
                     break;
                 }
-                
-                char next_char = file_pattern[pattern_pos + 1];
-                while (name_pos < filename.size() && filename[name_pos] != next_char) {
-                    name_pos++;
+            }
+        }
+    }
+
+    // Assignments in front of a command only go into its environment; the
+    // shell's own block is reused and just the overridden entries change
+    vector<vector<string>> assigns(pipeline.stages.size());
+    for (size_t i = 0; i < pipeline.stages.size(); i++) {
+        for (const auto &word : pipeline.stages[i].assignments) {
+            assigns[i].push_back(expand_text(word));
+        }
+    }
+    vector<shared_ptr<const EnvironmentBlock>> env_pins(pipeline.stages.size());
+    vector<vector<char*>> envs(pipeline.stages.size());
+    vector<char*const*> stage_envp(pipeline.stages.size(), nullptr);
+    bool has_env = false;
+    if (!commands[0].empty()) {
+        for (size_t i = 0; i < pipeline.stages.size(); i++) {
+            if (assigns[i].empty()) continue;
+            envs[i] = shell_vars.environment_with(assigns[i], env_pins[i]);
+            stage_envp[i] = envs[i].data();
+            has_env = true;
+        }
+    }
+
+    // A line of only redirections and assignments opens the files and sets
+    // the variables. Functions run inside the shell with any redirections
+    // applied around the call.
+    if (rc_recording) note_rc_command(pipeline, commands);
+    int status = 1;
+    auto function = functions.end();
+    if (ok && pipeline.stages.size() == 1 && !pipeline.background && !commands[0].empty()) {
+        function = functions.find(string(commands[0][0]));
+    }
+    if (function != functions.end()) {
+        status = with_fd_actions(stage_fds[0], [&] { return call_function(function->second, commands[0]); });
+    } else if (ok && commands[0].empty()) {
+        for (const auto &assign : assigns[0]) {
+            size_t eq = assign.find('=');
+            shell_vars.set(assign.substr(0, eq), assign.substr(eq + 1));
+        }
+        status = substitutions_run != substitutions ? last_status : 0;
+    } else if (ok) {
+        status = execute_pipeline(commands, stage_fds, pipeline.background, pipeline.text,
+                                  pipeline.timed || timing_all, has_env ? &stage_envp : nullptr);
+    }
+
+    for (int fd : opened) {
+        close(fd);
+    }
+    return status;
+}
+
+// Prepares a forked copy of the shell to run part of a command list on its
+// own: no job table, no terminal and a SIGCHLD pipe of its own
+static void enter_subshell() {
+    interactive = false;
+    job_control = false;
+    jobs.clear();
+    output_collector.reset();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        sigchld_pipe[0] = sigchld_pipe[1] = -1;
+    }
+}
+
+// Leaves a subshell without the parent's exit hooks, which restore the
+// terminal and write to stdout
+[[noreturn]] static void exit_subshell(int status) {
+    cout.flush();
+    _exit(status);
+}
+
+// Runs the jobs of a parallel block, at most max_jobs at a time. Each job is
+// a forked shell whose stdout and stderr go to a pipe read by the output
+// collector, which prefixes or groups its lines so jobs never interleave
+// mid-line; with jobout raw they write straight to stdout. Returns the
+// number of failed jobs, capped at 100.
+static int run_parallel(const vector<Program> &jobs, int max_jobs) {
+    if (rc_recording) rc_recording->replayable = false;
+    struct Running {
+        pid_t pid;
+        uint64_t output;    // collector stream, 0 when not collected
+        int status;         // -1 until reaped
+    };
+
+    size_t limit = max_jobs > 0 ? max_jobs : max(1u, thread::hardware_concurrency());
+    bool collect = job_output != JobOutput::Raw;
+    vector<Running> running;
+    size_t next = 0;
+    int failures = 0;
+    while (next < jobs.size() || !running.empty()) {
+        while (next < jobs.size() && running.size() < limit && !sigint_received) {
+            int out[2] = {-1, -1};
+            if (collect && pipe2(out, O_CLOEXEC) < 0) {
+                perror("pipe");
+                failures++;
+                next++;
+                continue;
+            }
+            cout.flush();
+            pid_t pid = fork();
+            if (pid == 0) { // Child process
+                enter_subshell();
+                if (collect) {
+                    dup2(out[1], STDOUT_FILENO);
+                    dup2(out[1], STDERR_FILENO);
+                    close(out[0]);
+                    close(out[1]);
                 }
-                pattern_pos++;
-            } else if (file_pattern[pattern_pos] == filename[name_pos]) {
-                pattern_pos++;
-                name_pos++;
+                exit_subshell(jobs[next]());
+            }
+            if (collect) close(out[1]);
+            if (pid < 0) {
+                perror("fork");
+                if (collect) close(out[0]);
+                failures++;
             } else {
-                match = false;
-                break;
+                uint64_t output = 0;
+                if (collect) output = output_collector.add(out[0], "[" + to_string(next + 1) + "] ");
+                running.push_back({pid, output, -1});
             }
+            next++;
         }
-    
-        if (match && pattern_pos == file_pattern.size() && name_pos == filename.size()) {
-            string full_path = dir_path;
-            if (dir_path != ".") full_path += "/";
-            full_path += filename;
-            matches.push_back(full_path);
+        if (sigint_received) {
+            next = jobs.size();
+        }
+        if (running.empty()) continue;
+
+        struct pollfd fds[2] = {
+            {sigchld_pipe[0], POLLIN, 0},
+            {output_collector.fd(), POLLIN, 0},
+        };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        char drain[64];
+        while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+        }
+        output_collector.flush();
+
+        // A job's slot frees once it has exited and its output is drained
+        for (auto it = running.begin(); it != running.end(); ) {
+            int status;
+            if (it->status == -1 && waitpid(it->pid, &status, WNOHANG) == it->pid) {
+                it->status = exit_code(status);
+            }
+            if (it->status == -1 || output_collector.is_open(it->output)) {
+                ++it;
+                continue;
+            }
+            if (it->status != 0) failures++;
+            it = running.erase(it);
         }
     }
-    
-    closedir(dir);
-    
-    if (matches.empty()) {
-        matches.push_back(pattern);
+    return min(failures, 100);
+}
+
+// Runs a chain in the background in a forked shell, which becomes the job.
+// Plain pipelines never get here; they are started as ordinary jobs.
+static int run_background(const AndOrList &chain, const Program &run) {
+    if (rc_recording) rc_recording->replayable = false;
+    int output[2] = {-1, -1};
+    if (collect_background() && pipe2(output, O_CLOEXEC) < 0) {
+        perror("pipe");
+        output[0] = output[1] = -1;
     }
-    
-    return matches;
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) { // Child process
+        setpgid(0, 0);
+        enter_subshell();
+        if (output[1] != -1) {
+            dup2(output[1], STDOUT_FILENO);
+            dup2(output[1], STDERR_FILENO);
+            close(output[0]);
+            close(output[1]);
+        }
+        exit_subshell(run());
+    }
+    if (output[1] != -1) {
+        close(output[1]);
+        if (pid < 0) {
+            close(output[0]);
+        } else {
+            output_collector.add(output[0], "[" + to_string(next_job_id()) + "] ");
+        }
+    }
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    setpgid(pid, pid);
+    return start_job(pid, {pid}, chain.text, true);
 }
 
-bool is_builtin(const string &cmd) {
-    return find(builtins.begin(), builtins.end(), cmd) != builtins.end();
+// Ends the current loop iteration once a break or continue is pending.
+// Returns true if the loop should stop.
+static bool loop_should_stop(int status) {
+    if (flow == Flow::Break || flow == Flow::Continue) {
+        if (--flow_levels > 0) return true;   // an outer loop takes it from here
+        Flow pending = flow;
+        flow = Flow::Normal;
+        return pending == Flow::Break;
+    }
+    return flow == Flow::Return || status == 128 + SIGINT || sigint_received;
 }
 
-int execute_builtin(const vector<string> &args) {
-    if (args[0] == "cd") {
-        handle_cd(args);
-    } else if (args[0] == "help") {
-        handle_help();
-    } else if (args[0] == "exit") {
-        handle_exit();
-        return -1;
-    } else if (args[0] == "history") {
-        handle_history(args);
-    } else if (args[0] == "pwd") {
-        handle_pwd();
-    } else if (args[0] == "ls") {
-        handle_ls(args);
-    } else if (args[0] == "alias") {
-        handle_alias(args);
+static Program compile_chain(const AndOrList &chain);
+
+static Program compile_compound(const CompoundCommand &command) {
+    switch (command.kind) {
+    case CompoundKind::Group:
+        return compile_list(command.bodies[0]);
+    case CompoundKind::Function: {
+        auto body = make_shared<const Program>(compile_list(command.bodies[0]));
+        string name = command.name;
+        return [name, body] {
+            functions[name] = {executing_parse, body, executing_parse ? executing_parse->text : string()};
+            return 0;
+        };
+    }
+    case CompoundKind::If: {
+        vector<pair<Program, Program>> branches;
+        for (size_t i = 0; i < command.conditions.size(); i++) {
+            branches.emplace_back(compile_list(command.conditions[i]), compile_list(command.bodies[i]));
+        }
+        Program otherwise;
+        if (command.bodies.size() > command.conditions.size()) {
+            otherwise = compile_list(command.bodies.back());
+        }
+        return [branches, otherwise] {
+            for (const auto &branch : branches) {
+                int status = branch.first();
+                if (flow != Flow::Normal) return status;
+                if (status == 0) return branch.second();
+            }
+            return otherwise ? otherwise() : 0;
+        };
+    }
+    case CompoundKind::While:
+    case CompoundKind::Until: {
+        Program condition = compile_list(command.conditions[0]);
+        Program body = compile_list(command.bodies[0]);
+        bool until = command.kind == CompoundKind::Until;
+        return [condition, body, until] {
+            int status = 0;
+            loop_depth++;
+            while (true) {
+                int test = condition();
+                if (flow == Flow::Normal) {
+                    if ((test == 0) == until || test == 128 + SIGINT) break;
+                    status = body();
+                }
+                if (loop_should_stop(status)) break;
+            }
+            loop_depth--;
+            return status;
+        };
+    }
+    case CompoundKind::For: {
+        Program body = compile_list(command.bodies[0]);
+        string name = command.name;
+        const CompoundCommand *node = &command;
+        return [body, name, node] {
+            deque<string> storage;
+            vector<string_view> values;
+            if (node->has_words) {
+                expand_words(node->words, values, storage);
+            } else {
+                values.assign(positional_args.begin(), positional_args.end());
+            }
+            int status = 0;
+            loop_depth++;
+            for (string_view value : values) {
+                shell_vars.set(name, string(value));
+                status = body();
+                if (loop_should_stop(status)) break;
+            }
+            loop_depth--;
+            return status;
+        };
+    }
+    }
+    return [] { return 0; };
+}
+
+static Program compile_item(const ChainItem &item) {
+    if (item.parallel) {
+        vector<Program> jobs;
+        for (const auto &job : item.parallel->jobs) {
+            jobs.push_back(compile_chain(job));
+        }
+        int max_jobs = item.parallel->max_jobs;
+        return [jobs, max_jobs] { return run_parallel(jobs, max_jobs); };
+    }
+    if (item.compound) {
+        return compile_compound(*item.compound);
+    }
+    const Pipeline *pipeline = &item.pipeline;
+    return [pipeline] { return execute_command(*pipeline); };
+}
+
+// Runs the items of one && / || chain in order, skipping an item when the
+// status of the one before says so
+static Program compile_chain(const AndOrList &chain) {
+    Program run;
+    if (chain.items.size() == 1) {
+        run = compile_item(chain.items[0]);
+    } else {
+        vector<pair<TokenKind, Program>> items;
+        for (const auto &item : chain.items) {
+            items.emplace_back(item.op, compile_item(item));
+        }
+        run = [items] {
+            int status = last_status;
+            for (const auto &item : items) {
+                if ((item.first == TokenKind::AndIf && status != 0) ||
+                    (item.first == TokenKind::OrIf && status == 0)) {
+                    continue;
+                }
+                status = item.second();
+                last_status = status;
+                if (flow != Flow::Normal) break;
+            }
+            return status;
+        };
+    }
+
+    const ChainItem &first = chain.items[0];
+    if (!chain.background || (chain.items.size() == 1 && !first.parallel && !first.compound)) {
+        return run;
+    }
+    const AndOrList *node = &chain;
+    return [node, run] { return run_background(*node, run); };
+}
+
+Program compile_list(const CommandList &list) {
+    vector<Program> chains;
+    for (const auto &chain : list.items) {
+        chains.push_back(compile_chain(chain));
+    }
+    if (chains.size() == 1) {
+        Program only = chains[0];
+        return [only] { return last_status = only(); };
     }
+    return [chains] {
+        int status = last_status;
+        for (const auto &chain : chains) {
+            status = chain();
+            last_status = status;
+            if (flow != Flow::Normal) break;
+        }
+        return status;
+    };
+}
+
+// break [N] and continue [N]
+static int loop_control(const vector<string> &args, Flow kind) {
+    const char *name = kind == Flow::Break ? "break" : "continue";
+    int levels = 1;
+    if (args.size() > 1 && (!parse_fd(args[1], levels) || levels < 1)) {
+        cerr << name << ": " << args[1] << ": loop count out of range" << endl;
+        return 1;
+    }
+    if (loop_depth == 0) {
+        cerr << name << ": only meaningful in a loop" << endl;
+        return 0;
+    }
+    flow = kind;
+    flow_levels = min(levels, loop_depth);
     return 0;
 }
 
-void handle_alias(const vector<string> &args) {
-    if (args.size() == 1) {
-        for (const auto &pair : aliases) {
-            cout << pair.first << "=" << pair.second << endl;
+int handle_break(const vector<string> &args) {
+    return loop_control(args, Flow::Break);
+}
+
+int handle_continue(const vector<string> &args) {
+    return loop_control(args, Flow::Continue);
+}
+
+// return [N]; the status defaults to that of the last command
+int handle_return(const vector<string> &args) {
+    if (function_depth == 0) {
+        cerr << "return: can only return from a function" << endl;
+        return 1;
+    }
+    int status = last_status;
+    if (args.size() > 1 && !parse_fd(args[1], status)) {
+        cerr << "return: " << args[1] << ": numeric argument required" << endl;
+        status = 2;
+    }
+    flow = Flow::Return;
+    return status & 0xff;
+}
+
+// Growable in-memory sink for builtin output captured by $(...)
+class CaptureBuffer : public streambuf {
+public:
+    explicit CaptureBuffer(string &out) : out(out) {}
+
+protected:
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof()) out += static_cast<char>(c);
+        return c;
+    }
+
+    streamsize xsputn(const char *data, streamsize n) override {
+        out.append(data, n);
+        return n;
+    }
+
+private:
+    string &out;
+};
+
+// Builtins that only print or test, and so can run inside the shell for
+// $(...) without changing its state
+static bool substitution_safe(string_view name) {
+    static const string_view safe[] = {"echo", "printf", "true", "false", "test", "[", "pwd"};
+    return std::find(std::begin(safe), std::end(safe), name) != std::end(safe);
+}
+
+// The output of a substituted command with trailing newlines removed. A
+// lone side-effect-free builtin, like $(pwd), runs inside the shell writing
+// straight into the buffer; anything else runs in a forked shell whose
+// stdout is a pipe read to the end. $? is left at the command's status.
+static string command_output(string_view command) {
+    if (rc_recording) rc_recording->replayable = false;
+    substitutions_run++;
+    string out;
+    auto parsed = parse_cached(string(command));
+    if (!parsed || parsed->incomplete || parsed->line.incomplete) {
+        if (parsed) cerr << "Syntax error: unexpected end of input" << endl;
+        last_status = 2;
+        return out;
+    }
+
+    const CommandList &list = parsed->list;
+    const Pipeline *single = nullptr;
+    if (list.items.size() == 1 && !list.items[0].background && list.items[0].items.size() == 1 &&
+        !list.items[0].items[0].parallel) {
+        single = &list.items[0].items[0].pipeline;
+    }
+    if (single && single->stages.size() == 1 && !single->timed &&
+        single->stages[0].redirects.empty() && single->stages[0].assignments.empty() &&
+        !single->stages[0].words.empty() && single->stages[0].words[0].source.empty()) {
+        const Stage &stage = single->stages[0];
+        const Builtin *builtin = find_builtin(stage.words[0].text);
+        if (builtin && substitution_safe(stage.words[0].text)) {
+            deque<string> storage;
+            vector<string_view> argv = stage.argv;
+            if (stage.expands) expand_words(stage.words, argv, storage);
+            cout.flush();
+            CaptureBuffer buffer(out);
+            streambuf *saved = cout.rdbuf(&buffer);
+            bool was_capturing = capturing_output;
+            capturing_output = true;
+            last_status = builtin->handler(materialize(argv));
+            capturing_output = was_capturing;
+            cout.rdbuf(saved);
+            while (!out.empty() && out.back() == '\n') out.pop_back();
+            return out;
         }
-    } else if (args.size() == 2) {
-        string definition = args[1];
-        size_t equal_pos = definition.find('=');
-        if (equal_pos == string::npos || equal_pos == 0) {
-            cerr << "alias: syntax error, expected NAME=VALUE" << endl;
-            return;
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        last_status = 1;
+        return out;
+    }
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) { // Child process
+        enter_subshell();
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        exit_subshell(parsed->program());
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        last_status = 1;
+        return out;
+    }
+
+    size_t used = 0;
+    while (true) {
+        if (out.size() - used < 4096) out.resize(max<size_t>(out.size() * 2, 16384));
+        ssize_t n = read(fds[0], &out[used], out.size() - used);
+        if (n > 0) {
+            used += n;
+        } else if (n == 0 || errno != EINTR) {
+            break;
         }
-        
-        string name = definition.substr(0, equal_pos);
-        string value = definition.substr(equal_pos + 1);
-        
-        if (!value.empty()) {
-            if ((value.front() == '\'' && value.back() == '\'') || 
-                (value.front() == '"' && value.back() == '"')) {
-                value = value.substr(1, value.size() - 2);
+    }
+    close(fds[0]);
+    out.resize(used);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    last_status = exit_code(status);
+    while (!out.empty() && out.back() == '\n') out.pop_back();
+    return out;
+}
+
+// Buffered line reader for scripts, -c strings and non-tty stdin. Input is
+// pulled in large blocks, so a script costs one read() per block instead of
+// one per line.
+class LineReader {
+public:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    explicit LineReader(int fd) : fd(fd), pos(0), eof(false) {}
+    explicit LineReader(const string &text) : fd(-1), buffer(text), pos(0), eof(true) {}
+
+    bool next_line(string &line) {
+        while (true) {
+            size_t newline = buffer.find('\n', pos);
+            if (newline != string::npos) {
+                line.assign(buffer, pos, newline - pos);
+                pos = newline + 1;
+                return true;
+            }
+
+            if (eof) {
+                if (pos < buffer.size()) {
+                    line.assign(buffer, pos, string::npos);
+                    pos = buffer.size();
+                    return true;
+                }
+                return false;
+            }
+
+            buffer.erase(0, pos);
+            pos = 0;
+            size_t used = buffer.size();
+            buffer.resize(used + BLOCK_SIZE);
+            ssize_t n;
+            do {
+                n = read(fd, &buffer[used], BLOCK_SIZE);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0) {
+                eof = true;
+                n = 0;
             }
+            buffer.resize(used + n);
         }
-        
-        aliases[name] = value;
-        
-        ofstream alias_file(".myshell_aliases", ios::app);
-        if (alias_file) {
-            alias_file << name << "=" << value << endl;
+    }
+
+private:
+    int fd;
+    string buffer;
+    size_t pos;
+    bool eof;
+};
+
+void clear_parse_cache() {
+    parse_cache_index.clear();
+    parse_cache.clear();
+}
+
+// Returns the parsed form of input, reusing a cached one when the same line
+// was parsed recently. Returns null after reporting a syntax error.
+shared_ptr<const ParsedCommand> parse_cached(const string &input) {
+    TraceScope trace(TracePhase::Parse);
+    auto it = parse_cache_index.find(input);
+    if (it != parse_cache_index.end()) {
+        parse_cache.splice(parse_cache.begin(), parse_cache, it->second);
+        return it->second->second;
+    }
+
+    auto parsed = make_shared<ParsedCommand>();
+    parsed->text = input;
+    parse_command(input, parsed->line);
+    if (parsed->line.incomplete) {
+        // Still waiting for a here-document delimiter
+        return parsed;
+    }
+    {
+        TraceScope trace(TracePhase::Ast);
+        if (!parse_list(parsed->line.tokens, parsed->list, parsed->incomplete)) {
+            // Ran out of input after && or | or inside a block
+            if (parsed->incomplete) return parsed;
+            return nullptr;
+        }
+        parsed->program = compile_list(parsed->list);
+    }
+
+    if (parse_cache.size() >= PARSE_CACHE_SIZE) {
+        parse_cache_index.erase(parse_cache.back().first);
+        parse_cache.pop_back();
+    }
+    parse_cache.emplace_front(input, parsed);
+    parse_cache_index.emplace(parse_cache.front().first, parse_cache.begin());
+    return parsed;
+}
+
+// Expand aliases, parse and execute one input line. Lines that open a
+// here-document or leave a list unfinished pull the following lines from
+// more until the command is complete; entered then gets the whole text
+// before it runs. A syntax error gives status 2.
+int run_line(string input, const MoreInput &more,
+             const function<void(const string &text)> &entered) {
+    auto parsed = parse_cached(input);
+    string next;
+    while (parsed && (parsed->line.incomplete || parsed->incomplete)) {
+        if (!more || !more(next)) {
+            if (!parsed->line.incomplete) {
+                if (entered) entered(input);
+                cerr << "Syntax error: unexpected end of input" << endl;
+                return 2;
+            }
+            cerr << "liteshell: warning: here-document delimited by end-of-file" << endl;
+            auto partial = make_shared<ParsedCommand>();
+            partial->text = input;
+            parse_command(input, partial->line);
+            if (!parse_list(partial->line.tokens, partial->list, partial->incomplete)) {
+                if (partial->incomplete) cerr << "Syntax error: unexpected end of input" << endl;
+                return 2;
+            }
+            partial->program = compile_list(partial->list);
+            parsed = partial;
+            break;
+        }
+        input += '\n';
+        input += next;
+
+        // Inside a here-document only a delimiter line can complete it, so
+        // skip reparsing otherwise
+        if (parsed->line.incomplete) {
+            size_t start = next.find_first_not_of('\t');
+            string_view text = start == string::npos ? string_view() : string_view(next).substr(start);
+            const auto &open = parsed->line.open_heredocs;
+            if (find(open.begin(), open.end(), next) == open.end() &&
+                find(open.begin(), open.end(), text) == open.end()) {
+                continue;
+            }
+        }
+        parsed = parse_cached(input);
+    }
+    if (entered) entered(input);
+    if (!parsed) {
+        return 2;
+    }
+
+    // Skip if no command was entered
+    if (parsed->line.tokens.empty()) {
+        return last_status;
+    }
+
+    shared_ptr<const ParsedCommand> saved = executing_parse;
+    executing_parse = parsed;
+    int status = parsed->program();
+    executing_parse = saved;
+    flow = Flow::Normal;
+    return status;
+}
+
+int run_script(LineReader &reader) {
+    string line;
+    while (reader.next_line(line)) {
+        size_t first = line.find_first_not_of(" \t");
+        if (first == string::npos || line[first] == '#') {
+            continue;
         }
-    } else {
-        cerr << "alias: too many arguments" << endl;
+        last_status = run_line(line, [&](string &more) { return reader.next_line(more); });
+        notify_jobs();
     }
+    return last_status;
 }
 
-void handle_history(const vector<string> &args) {
-    int show_count = command_history.size();
-    
-    if (args.size() > 1) {
-        try {
-            show_count = stoi(args[1]);
-            if (show_count < 0) {
-                cout << "history: count must be positive" << endl;
-                return;
-            }
-            show_count = min(show_count, (int)command_history.size());
-        } catch (const invalid_argument&) {
-            cout << "history: " << args[1] << ": numeric argument required" << endl;
-            return;
+// Tab completion ----------------------------------------------------------
+
+// Sorted names of the executables on PATH, for completing command names.
+// It is built on a worker thread, first at startup, so reading large bin
+// directories never holds up the prompt. Each directory's entries are kept
+// with its mtime, and a refresh re-reads only the directories that changed.
+class PathIndex {
+public:
+    struct Dir {
+        string path;
+        struct timespec mtime;
+        ino_t inode;
+        time_t read_at;
+        vector<string> names;
+    };
+
+    // A rebuild in progress is waited for. The worker is detached, since a
+    // forked child that calls exit() has a copy of this object but no worker.
+    ~PathIndex() {
+        if (getpid() != owner) return;
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [this] { return !building; });
+    }
+
+    // Starts a rebuild if PATH or a directory on it changed since the last
+    // one, then waits up to wait for a rebuild in progress; until it is done
+    // the previous index is used
+    void refresh(const string &path, chrono::milliseconds wait = chrono::milliseconds(0)) {
+        unique_lock<mutex> guard(lock);
+        if (!building && (path != built_path || stale())) {
+            building = true;
+            thread(&PathIndex::build, this, path, dirs).detach();
+        }
+        if (building && wait.count() > 0) {
+            done.wait_for(guard, wait, [this] { return !building; });
         }
     }
-    
-    int start_index = max(0, (int)command_history.size() - show_count);
-    for (int i = start_index; i < command_history.size(); i++) {
-        cout << " " << i + 1 << "  " << command_history[i] << endl;
+
+    // Appends the names that start with prefix, in order
+    void complete(string_view prefix, vector<string> &out) {
+        lock_guard<mutex> guard(lock);
+        auto it = lower_bound(names.begin(), names.end(), prefix,
+                              [](const string &name, string_view p) { return name < p; });
+        for (; it != names.end() && string_view(*it).substr(0, prefix.size()) == prefix; ++it) {
+            out.push_back(*it);
+        }
     }
-}
 
-void handle_pwd() {
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd))) {
-        cout << cwd << endl;
-    } else {
-        perror("pwd");
+    // The finished index and the PATH it was built from, e.g. to save in the
+    // rc snapshot. generation counts the builds since it was last restored.
+    vector<Dir> saved(string &path) {
+        lock_guard<mutex> guard(lock);
+        path = built_path;
+        return dirs;
     }
-}
 
-void handle_ls(const vector<string> &args) {
-    string path = ".";
-    bool show_all = false;
-    bool long_format = false;
-    bool color = true;
-    
-    vector<string> paths;
-    for (size_t i = 1; i < args.size(); i++) {
-        if (args[i][0] == '-') {
-            for (char c : args[i].substr(1)) {
-                if (c == 'a') show_all = true;
-                if (c == 'l') long_format = true;
-                if (c == 'C') color = true;
-            }
-        } else {
-            paths.push_back(args[i]);
+    uint64_t generation() {
+        lock_guard<mutex> guard(lock);
+        return builds;
+    }
+
+    // Starts from a saved index; refresh() then re-reads only the
+    // directories that changed since it was saved
+    void restore(string path, vector<Dir> saved) {
+        lock_guard<mutex> guard(lock);
+        if (building) return;
+        names = merge(saved);
+        dirs = move(saved);
+        built_path = move(path);
+        builds = 0;
+    }
+
+private:
+    pid_t owner = getpid();
+    mutex lock;
+    condition_variable done;
+    bool building = false;
+    string built_path;
+    vector<Dir> dirs;           // in PATH order
+    vector<string> names;       // every directory's names, sorted and unique
+    uint64_t builds = 0;
+
+    static vector<string> merge(const vector<Dir> &dirs) {
+        vector<string> merged;
+        for (const Dir &dir : dirs) {
+            merged.insert(merged.end(), dir.names.begin(), dir.names.end());
         }
+        sort(merged.begin(), merged.end());
+        merged.erase(unique(merged.begin(), merged.end()), merged.end());
+        return merged;
     }
-    
-    if (paths.empty()) {
-        paths.push_back(".");
+
+    // A listing read in the same second as the directory's last change may
+    // have missed a later change with the same coarse timestamp
+    static bool current(const Dir &dir, const struct stat &st) {
+        return dir.inode == st.st_ino && dir.mtime.tv_sec == st.st_mtim.tv_sec &&
+               dir.mtime.tv_nsec == st.st_mtim.tv_nsec && dir.read_at > st.st_mtim.tv_sec;
     }
-    
-    for (const auto &path : paths) {
-        if (paths.size() > 1) {
-            cout << path << ":" << endl;
+
+    bool stale() const {
+        for (const Dir &dir : dirs) {
+            struct stat st;
+            if (stat(dir.path.c_str(), &st) == 0 ? !current(dir, st) : dir.inode != 0) return true;
         }
-        
-        DIR *dir;
-        struct dirent *ent;
-        if ((dir = opendir(path.c_str())) != nullptr) {
-            vector<string> entries;
-            while ((ent = readdir(dir)) != nullptr) {
-                if (!show_all && ent->d_name[0] == '.') continue;
-                entries.push_back(ent->d_name);
-            }
-            closedir(dir);
-            
-            sort(entries.begin(), entries.end());
-            
-            for (const auto &entry : entries) {
-                if (long_format) {
-                    cout << entry << endl;
-                } else {
-                    if (color) {
-                        string color_code;
-                        string full_path = path + "/" + entry;
-                        
-                        struct stat st;
-                        if (stat(full_path.c_str(), &st) == 0) {
-                            if (S_ISDIR(st.st_mode)) {
-                                color_code = Colors::BLUE + Colors::BOLD;
-                            } else if (st.st_mode & S_IXUSR) {
-                                color_code = Colors::GREEN;
-                            } else if (S_ISREG(st.st_mode)) {
-                                size_t dot_pos = entry.rfind('.');
-                                if (dot_pos != string::npos) {
-                                    string ext = entry.substr(dot_pos + 1);
-                                    if (ext == "c" || ext == "cpp" || ext == "h") {
-                                        color_code = Colors::CYAN;
-                                    } else if (ext == "jpg" || ext == "png" || ext == "gif") {
-                                        color_code = Colors::MAGENTA;
-                                    } else if (ext == "zip" || ext == "tar" || ext == "gz") {
-                                        color_code = Colors::RED;
-                                    }
-                                }
-                            }
-                        }
-                        
-                        cout << color_code << entry << Colors::RESET << " ";
-                    } else {
-                        cout << entry << " ";
+        return false;
+    }
+
+    void build(string path, vector<Dir> previous) {
+        vector<Dir> fresh;
+        size_t start = 0;
+        while (start <= path.size()) {
+            size_t end = path.find(':', start);
+            if (end == string::npos) end = path.size();
+            Dir dir{path.substr(start, end - start), {0, 0}, 0, 0, {}};
+            if (dir.path.empty()) dir.path = ".";
+            start = end + 1;
+
+            struct stat st;
+            if (stat(dir.path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+                fresh.push_back(move(dir));
+                continue;
+            }
+            auto old = find_if(previous.begin(), previous.end(),
+                               [&](const Dir &d) { return d.path == dir.path; });
+            if (old != previous.end() && current(*old, st)) {
+                fresh.push_back(move(*old));
+                continue;
+            }
+
+            dir.mtime = st.st_mtim;
+            dir.inode = st.st_ino;
+            dir.read_at = time(nullptr);
+            DIR *d = opendir(dir.path.c_str());
+            if (d) {
+                int fd = dirfd(d);
+                struct dirent *entry;
+                while ((entry = readdir(d))) {
+                    if (entry->d_name[0] == '.' || entry->d_type == DT_DIR) continue;
+                    struct stat file;
+                    if (fstatat(fd, entry->d_name, &file, 0) == 0 && S_ISREG(file.st_mode) &&
+                        faccessat(fd, entry->d_name, X_OK, 0) == 0) {
+                        dir.names.push_back(entry->d_name);
                     }
                 }
+                closedir(d);
             }
-            
-            if (!long_format) cout << endl;
-        } else {
-            perror("ls");
+            fresh.push_back(move(dir));
         }
+
+        vector<string> merged = merge(fresh);
+
+        lock_guard<mutex> guard(lock);
+        dirs = move(fresh);
+        names = move(merged);
+        built_path = move(path);
+        builds++;
+        building = false;
+        done.notify_all();
     }
+};
+
+PathIndex path_index;
+
+void refresh_path_index(chrono::milliseconds wait) {
+    const string *path = shell_vars.get("PATH");
+    path_index.refresh(path ? *path : string(), wait);
 }
 
-void handle_cd(const vector<string> &args) {
-    if (!isatty(STDIN_FILENO)) {
-        cerr << "cd: cannot be used in a pipeline" << endl;
-        return;
-    }
+// True if a word starting at start in line names a command: it opens the
+// line or follows an operator, a keyword or prefix assignments
+static bool at_command_position(string_view line, size_t start) {
+    size_t i = start;
+    while (i > 0 && (line[i - 1] == ' ' || line[i - 1] == '\t')) i--;
+    if (i == 0 || strchr("|&;(`", line[i - 1])) return true;
 
-    if (args.size() == 1) {
-        const char *home = getenv("HOME");
-        if (home) {
-            if (chdir(home) != 0) {
-                perror("cd");
+    size_t j = i;
+    while (j > 0 && !strchr(" \t|&;(`", line[j - 1])) j--;
+    string_view word = line.substr(j, i - j);
+    static const string_view keywords[] = {"!", "do", "elif", "else", "if", "then", "time", "until",
+                                           "while", "{"};
+    if (std::find(std::begin(keywords), std::end(keywords), word) != std::end(keywords)) return true;
+    size_t eq = word.find('=');
+    return eq != string_view::npos && valid_name(string(word.substr(0, eq))) && at_command_position(line, j);
+}
+
+// The candidates for the word text at start in line: variable names after
+// '$', commands (builtins, functions, aliases and PATH) in command position
+// and file names otherwise. filenames is set when they name files.
+vector<string> completion_candidates(string_view line, size_t start, const string &text,
+                                     bool &filenames) {
+    vector<string> matches;
+    filenames = false;
+
+    if (!text.empty() && text[0] == '$') {
+        bool braced = text.size() > 1 && text[1] == '{';
+        string_view prefix = string_view(text).substr(braced ? 2 : 1);
+        for (const auto &var : shell_vars.all()) {
+            if (string_view(var.first).substr(0, prefix.size()) == prefix) {
+                matches.push_back((braced ? "${" : "$") + var.first + (braced ? "}" : ""));
             }
         }
-    } else if (args.size() == 2) {
-        string path = args[1];
-        if (path == "-") {
-            const char *oldpwd = getenv("OLDPWD");
-            if (oldpwd) {
-                cout << oldpwd << endl;
-                if (chdir(oldpwd) != 0) {
-                    perror("cd");
-                }
-            } else {
-                cerr << "cd: OLDPWD not set" << endl;
-            }
-        } else {
-            char cwd[1024];
-            if (getcwd(cwd, sizeof(cwd))) {
-                setenv("OLDPWD", cwd, 1);
-                if (chdir(path.c_str()) != 0) {
-                    perror("cd");
-                }
-            }
+    } else if (text.find('/') == string::npos && at_command_position(line, start)) {
+        for (const Builtin &builtin : builtin_table) {
+            if (builtin.name.substr(0, text.size()) == text) matches.emplace_back(builtin.name);
         }
+        for (const auto &alias : aliases) {
+            if (alias.first.compare(0, text.size(), text) == 0) matches.push_back(alias.first);
+        }
+        for (const auto &function : functions) {
+            if (function.first.compare(0, text.size(), text) == 0) matches.push_back(function.first);
+        }
+        refresh_path_index(chrono::milliseconds(100));
+        path_index.complete(text, matches);
     } else {
-        cerr << "cd: too many arguments" << endl;
+        // Directory listings come from the glob engine's cache
+        filenames = true;
+        size_t slash = text.rfind('/');
+        string dir = slash == string::npos ? "" : text.substr(0, slash + 1);
+        string base = text.substr(dir.size());
+        string read = dir.empty() ? "." : dir;
+        const char *home = getenv("HOME");
+        if (read.compare(0, 2, "~/") == 0 && home) read = home + read.substr(1);
+        const DirListing *listing = read_dir_cached(read);
+        if (listing) {
+            auto it = lower_bound(listing->names.begin(), listing->names.end(), base);
+            for (; it != listing->names.end() && it->compare(0, base.size(), base) == 0; ++it) {
+                if ((*it)[0] == '.' && (base.empty() || base[0] != '.')) continue;
+                matches.push_back(dir + *it);
+            }
+        }
     }
-}
 
-void handle_help() {
-    cout << "Enhanced C++ Shell" << endl;
-    cout << "Built-in commands:" << endl;
-    cout << "  cd [dir]       - Change directory (use '-' for previous directory)" << endl;
-    cout << "  help           - Show this help message" << endl;
-    cout << "  history [n]    - Show command history (last n commands)" << endl;
-    cout << "  pwd            - Print working directory" << endl;
-    cout << "  ls [options]   - List directory contents (-a: show hidden, -l: long format)" << endl;
-    cout << "  alias [name=value] - Create or list command aliases" << endl;
-    cout << "  exit           - Exit the shell" << endl;
-    cout << "Features:" << endl;
-    cout << "  I/O redirection: <, >, >>" << endl;
-    cout << "  Piping: command1 | command2" << endl;
-    cout << "  Wildcards: *, ?" << endl;
-    cout << "  Tab completion for commands and filenames" << endl;
-    cout << "  Command history with up/down arrows" << endl;
-    cout << "  Background execution with &" << endl;
+    sort(matches.begin(), matches.end());
+    matches.erase(unique(matches.begin(), matches.end()), matches.end());
+    return matches;
 }
 
-void handle_exit() {
-    cout << "Goodbye!" << endl;
-    save_history();
-    cleanup_terminal();
-    exit(0);
-}
+// readline's completion hook. Returns the matches with their longest common
+// prefix first, as readline expects, or null for none. readline's own
+// filename completion is never used as a fallback.
+char **complete_line(const char *text, int start, int end) {
+    rl_attempted_completion_over = 1;
+    bool filenames;
+    vector<string> matches = completion_candidates(rl_line_buffer, start, text, filenames);
+    if (matches.empty()) return nullptr;
+    // Marks directories with '/' and quotes special characters
+    rl_filename_completion_desired = filenames;
+    rl_filename_quoting_desired = filenames;
 
-void execute_pipeline(const vector<vector<string>> &commands) {
-    if (commands.empty()) return;
-    
-    // Handle single builtin command specially (no pipe needed)
-    if (commands.size() == 1 && is_builtin(commands[0][0])) {
-        execute_builtin(commands[0]);
-        return;
+    size_t common = matches[0].size();
+    for (const string &match : matches) {
+        size_t i = 0;
+        while (i < common && i < match.size() && match[i] == matches[0][i]) i++;
+        common = i;
+    }
+    char **result = (char **)malloc((matches.size() + 2) * sizeof(char *));
+    result[0] = strdup(matches[0].substr(0, common).c_str());
+    for (size_t i = 0; i < matches.size(); i++) {
+        result[i + 1] = strdup(matches[i].c_str());
     }
+    result[matches.size() + 1] = nullptr;
+    return result;
+}
 
-    int num_commands = commands.size();
-    int prev_pipe_read = -1;
-    vector<pid_t> pids;
+// Startup file -----------------------------------------------------------
 
-    for (int i = 0; i < num_commands; i++) {
-        int pipefd[2];
-        
-        // Create pipe for all commands except the last one
-        if (i < num_commands - 1) {
-            if (pipe(pipefd) < 0) {
-                perror("pipe");
-                return;
-            }
-        }
+// ~/.liteshellrc runs first in every new shell, interactive or not. When it
+// only defines aliases, variables and functions, the state it leaves is
+// saved to ~/.liteshellrc.snapshot, and later shells load that instead of
+// running the rc. The snapshot holds while the rc's mtime, size and inode
+// and the inherited values of each variable the rc expanded are unchanged.
+// Functions are restored as the source of the line that defined them and
+// compiled on first call. An interactive shell adds its PATH completion
+// index on exit, so the next one need not read the bin directories.
+// LITESHELL_SNAPSHOT=off in the environment turns the snapshot off.
+const string RC_FILE = ".liteshellrc";
+const string RC_SNAPSHOT = ".liteshellrc.snapshot";
+const string SNAPSHOT_MAGIC = "LSHSNAP1";
 
-        pid_t pid = fork();
-        if (pid == 0) { // Child process
-            // If not first command, connect previous pipe to stdin
-            if (i > 0) {
-                dup2(prev_pipe_read, STDIN_FILENO);
-                close(prev_pipe_read);
-            }
+struct RcSnapshot {
+    struct RcVariable {
+        string name;
+        string value;
+        bool exported;
+        bool unset;             // removed by the rc
+    };
 
-            // If not last command, connect current pipe to stdout
-            if (i < num_commands - 1) {
-                close(pipefd[0]); // Close read end in child
-                dup2(pipefd[1], STDOUT_FILENO);
-                close(pipefd[1]);
-            }
+    // A variable the rc expanded, as it was inherited
+    struct RcRead {
+        string name;
+        bool was_set;
+        string value;
+    };
 
-            // Execute the command
-            if (is_builtin(commands[i][0])) {
-                execute_builtin(commands[i]);
-                exit(EXIT_SUCCESS);
-            } else {
-                vector<char*> argv;
-                for (const auto &arg : commands[i]) {
-                    argv.push_back(const_cast<char*>(arg.c_str()));
-                }
-                argv.push_back(nullptr);
+    struct timespec mtime;
+    off_t size;
+    ino_t inode;
+    vector<RcRead> reads;
+    vector<RcVariable> variables;
+    vector<pair<string, string>> aliases;
+    vector<pair<string, string>> functions;         // name, defining line
+};
 
-                execvp(argv[0], argv.data());
-                perror("execvp");
-                exit(EXIT_FAILURE);
-            }
-        } else if (pid < 0) {
-            perror("fork");
-            return;
-        }
+RcSnapshot rc_snapshot;
+bool rc_snapshot_active = false;
+uint64_t rc_snapshot_index_generation = 0;
 
-        // Parent process
-        // Close previous pipe read end if it exists
-        if (i > 0) {
-            close(prev_pipe_read);
-        }
+class SnapshotWriter {
+public:
+    void u64(uint64_t value) { out.append((const char *)&value, 8); }
+    void str(string_view text) {
+        u64(text.size());
+        out.append(text);
+    }
+    string out;
+};
 
-        // Save read end of current pipe for next command
-        if (i < num_commands - 1) {
-            close(pipefd[1]); // Close write end in parent
-            prev_pipe_read = pipefd[0];
+class SnapshotReader {
+public:
+    explicit SnapshotReader(string_view data) : data(data) {}
+    uint64_t u64() {
+        uint64_t value = 0;
+        if (data.size() - pos < 8) {
+            ok = false;
+        } else {
+            memcpy(&value, data.data() + pos, 8);
+            pos += 8;
         }
-
-        pids.push_back(pid);
+        return value;
+    }
+    string str() {
+        uint64_t n = u64();
+        if (!ok || n > data.size() - pos) {
+            ok = false;
+            return string();
+        }
+        pos += n;
+        return string(data.substr(pos - n, n));
     }
+    bool ok = true;
+
+private:
+    string_view data;
+    size_t pos = 0;
+};
+
+static string rc_path(const string &name) {
+    const char *home = getenv("HOME");
+    return home ? string(home) + "/" + name : string();
+}
 
-    // Close last pipe read end if it exists
-    if (prev_pipe_read != -1) {
-        close(prev_pipe_read);
+static void write_rc_snapshot() {
+    SnapshotWriter w;
+    w.out = SNAPSHOT_MAGIC;
+    const RcSnapshot &snap = rc_snapshot;
+    w.u64(snap.mtime.tv_sec);
+    w.u64(snap.mtime.tv_nsec);
+    w.u64(snap.size);
+    w.u64(snap.inode);
+    w.u64(snap.reads.size());
+    for (const auto &read : snap.reads) {
+        w.str(read.name);
+        w.u64(read.was_set);
+        w.str(read.value);
+    }
+    w.u64(snap.variables.size());
+    for (const auto &var : snap.variables) {
+        w.str(var.name);
+        w.str(var.value);
+        w.u64(var.exported | var.unset << 1);
+    }
+    w.u64(snap.aliases.size());
+    for (const auto &alias : snap.aliases) {
+        w.str(alias.first);
+        w.str(alias.second);
+    }
+    w.u64(snap.functions.size());
+    for (const auto &function : snap.functions) {
+        w.str(function.first);
+        w.str(function.second);
+    }
+    // Last, so a non-interactive shell can stop reading before it
+    string index_path;
+    vector<PathIndex::Dir> dirs = path_index.saved(index_path);
+    w.str(index_path);
+    w.u64(dirs.size());
+    for (const auto &dir : dirs) {
+        w.str(dir.path);
+        w.u64(dir.mtime.tv_sec);
+        w.u64(dir.mtime.tv_nsec);
+        w.u64(dir.inode);
+        w.u64(dir.read_at);
+        w.u64(dir.names.size());
+        for (const auto &name : dir.names) w.str(name);
     }
 
-    // Wait for all children to complete
-    for (pid_t pid : pids) {
-        waitpid(pid, nullptr, 0);
+    string path = rc_path(RC_SNAPSHOT);
+    string tmp = path + ".tmp." + to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd != -1 && write(fd, w.out.data(), w.out.size()) == (ssize_t)w.out.size();
+    if (fd != -1) close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
     }
 }
 
-int execute_command(const vector<string> &args) {
-    if (args.empty()) {
-        return 0;
+// Loads and applies the snapshot if it still matches rc's stat and the
+// inherited variables; false if the rc has to run
+static bool load_rc_snapshot(const struct stat &rc) {
+    int fd = open(rc_path(RC_SNAPSHOT).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    string data;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        data.resize(st.st_size);
+        if (read(fd, &data[0], data.size()) != (ssize_t)data.size()) data.clear();
     }
-    
-    bool background = false;
-    vector<string> cmd_args = args;
-    
-    // Check for background execution
-    if (!cmd_args.empty() && cmd_args.back() == "&") {
-        background = true;
-        cmd_args.pop_back();
+    close(fd);
+    if (data.compare(0, SNAPSHOT_MAGIC.size(), SNAPSHOT_MAGIC) != 0) return false;
+
+    SnapshotReader r(string_view(data).substr(SNAPSHOT_MAGIC.size()));
+    RcSnapshot snap;
+    snap.mtime.tv_sec = r.u64();
+    snap.mtime.tv_nsec = r.u64();
+    snap.size = r.u64();
+    snap.inode = r.u64();
+    if (!r.ok || snap.mtime.tv_sec != rc.st_mtim.tv_sec || snap.mtime.tv_nsec != rc.st_mtim.tv_nsec ||
+        snap.size != rc.st_size || snap.inode != rc.st_ino) {
+        return false;
     }
-    
-    string input_file, output_file;
-    bool append = false;
-    
-    // Process redirections
-    for (size_t i = 0; i < cmd_args.size(); ) {
-        if (cmd_args[i] == "<") {
-            if (i + 1 < cmd_args.size()) {
-                input_file = cmd_args[i + 1];
-                cmd_args.erase(cmd_args.begin() + i, cmd_args.begin() + i + 2);
-            } else {
-                cerr << "Syntax error: no input file specified" << endl;
-                return -1;
-            }
-        } else if (cmd_args[i] == ">") {
-            if (i + 1 < cmd_args.size()) {
-                output_file = cmd_args[i + 1];
-                append = false;
-                cmd_args.erase(cmd_args.begin() + i, cmd_args.begin() + i + 2);
-            } else {
-                cerr << "Syntax error: no output file specified" << endl;
-                return -1;
-            }
-        } else if (cmd_args[i] == ">>") {
-            if (i + 1 < cmd_args.size()) {
-                output_file = cmd_args[i + 1];
-                append = true;
-                cmd_args.erase(cmd_args.begin() + i, cmd_args.begin() + i + 2);
-            } else {
-                cerr << "Syntax error: no output file specified" << endl;
-                return -1;
-            }
-        } else {
-            i++;
+    for (uint64_t n = r.u64(); r.ok && n > 0; n--) {
+        string name = r.str();
+        bool was_set = r.u64();
+        string value = r.str();
+        const string *now = shell_vars.get(name);
+        if (was_set != (now != nullptr) || (now && *now != value)) return false;
+        snap.reads.push_back({move(name), was_set, move(value)});
+    }
+    for (uint64_t n = r.u64(); r.ok && n > 0; n--) {
+        RcSnapshot::RcVariable var;
+        var.name = r.str();
+        var.value = r.str();
+        uint64_t flags = r.u64();
+        var.exported = flags & 1;
+        var.unset = flags & 2;
+        snap.variables.push_back(move(var));
+    }
+    for (uint64_t n = r.u64(); r.ok && n > 0; n--) {
+        string name = r.str();
+        snap.aliases.emplace_back(move(name), r.str());
+    }
+    for (uint64_t n = r.u64(); r.ok && n > 0; n--) {
+        string name = r.str();
+        snap.functions.emplace_back(move(name), r.str());
+    }
+    if (!r.ok) return false;
+
+    if (interactive) {
+        string index_path = r.str();
+        vector<PathIndex::Dir> dirs;
+        for (uint64_t n = r.u64(); r.ok && n > 0; n--) {
+            PathIndex::Dir dir;
+            dir.path = r.str();
+            dir.mtime.tv_sec = r.u64();
+            dir.mtime.tv_nsec = r.u64();
+            dir.inode = r.u64();
+            dir.read_at = r.u64();
+            for (uint64_t k = r.u64(); r.ok && k > 0; k--) dir.names.push_back(r.str());
+            dirs.push_back(move(dir));
         }
+        if (r.ok && !dirs.empty()) path_index.restore(move(index_path), move(dirs));
     }
-    
-    // Process pipelines
-    vector<vector<string>> pipe_commands;
-    vector<string> current_command;
-    
-    for (const auto &arg : cmd_args) {
-        if (arg == "|") {
-            if (!current_command.empty()) {
-                pipe_commands.push_back(current_command);
-                current_command.clear();
-            }
+
+    for (const auto &var : snap.variables) {
+        if (var.unset) {
+            shell_vars.unset(var.name);
         } else {
-            current_command.push_back(arg);
+            shell_vars.set(var.name, var.value, var.exported);
         }
     }
-    
-    if (!current_command.empty()) {
-        pipe_commands.push_back(current_command);
+    for (const auto &alias : snap.aliases) {
+        set_alias(alias.first, alias.second, true);
     }
-    
-    if (pipe_commands.size() > 1) {
-        execute_pipeline(pipe_commands);
-        return 0;
+    for (const auto &function : snap.functions) {
+        functions[function.first] = {nullptr, nullptr, function.second};
     }
-    
-    // Handle simple command with redirection
-    if (!cmd_args.empty() && is_builtin(cmd_args[0])) {
-        return execute_builtin(cmd_args);
+    rc_snapshot = move(snap);
+    return true;
+}
+
+// Runs ~/.liteshellrc, or applies its snapshot when that is still valid
+void load_rc() {
+    string path = rc_path(RC_FILE);
+    struct stat rc;
+    if (path.empty() || stat(path.c_str(), &rc) != 0) return;
+    const string *setting = shell_vars.get("LITESHELL_SNAPSHOT");
+    bool use_snapshot = !setting || *setting != "off";
+    if (use_snapshot && load_rc_snapshot(rc)) {
+        rc_snapshot_active = true;
+        rc_snapshot_index_generation = path_index.generation();
+        return;
     }
-    
-    if (!input_file.empty() || !output_file.empty()) {
-        pid_t pid = fork();
-        
-        if (pid == 0) { // Child process
-            if (!input_file.empty()) {
-                int fd = open(input_file.c_str(), O_RDONLY);
-                if (fd < 0) {
-                    perror("open input file");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
-            }
-            
-            if (!output_file.empty()) {
-                int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
-                int fd = open(output_file.c_str(), flags, 0644);
-                if (fd < 0) {
-                    perror("open output file");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
-            }
-            
-            vector<char*> argv;
-            for (const auto &arg : cmd_args) {
-                argv.push_back(const_cast<char*>(arg.c_str()));
-            }
-            argv.push_back(nullptr);
-            
-            execvp(argv[0], argv.data());
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            perror("fork");
-            return -1;
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path.c_str());
+        return;
+    }
+    unordered_map<string, ShellVariable> inherited = shell_vars.all();
+    RcRecording recording;
+    rc_recording = &recording;
+    LineReader reader(fd);
+    run_script(reader);
+    rc_recording = nullptr;
+    close(fd);
+    last_status = 0;
+
+    if (!use_snapshot) return;
+    if (!recording.replayable) {
+        // It has effects beyond the shell's own state, so it runs every time
+        unlink(rc_path(RC_SNAPSHOT).c_str());
+        return;
+    }
+
+    RcSnapshot snap;
+    snap.mtime = rc.st_mtim;
+    snap.size = rc.st_size;
+    snap.inode = rc.st_ino;
+    for (const string &name : recording.reads) {
+        auto it = inherited.find(name);
+        bool was_set = it != inherited.end();
+        snap.reads.push_back({name, was_set, was_set ? it->second.value : string()});
+    }
+    for (const string &name : recording.writes) {
+        auto it = shell_vars.all().find(name);
+        if (it == shell_vars.all().end()) {
+            snap.variables.push_back({name, "", false, true});
         } else {
-            if (!background) {
-                int status;
-                waitpid(pid, &status, 0);
-                reset_terminal();
-                return status;
-            } else {
-                cout << "[" << pid << "]" << endl;
-                return 0;
-            }
+            snap.variables.push_back({name, it->second.value, it->second.exported, false});
         }
     }
-    
-    // Handle simple command without redirection
-    pid_t pid = fork();
-    
-    if (pid == 0) { // Child process
-        vector<char*> argv;
-        for (const auto &arg : cmd_args) {
-            argv.push_back(const_cast<char*>(arg.c_str()));
+    for (const auto &alias : aliases) {
+        if (alias.second.from_rc) snap.aliases.emplace_back(alias.first, alias.second.value);
+    }
+    for (const auto &function : functions) {
+        snap.functions.emplace_back(function.first, function.second.source);
+    }
+    rc_snapshot = move(snap);
+    rc_snapshot_active = true;
+    write_rc_snapshot();
+    rc_snapshot_index_generation = path_index.generation();
+}
+
+// On exit: keeps the snapshot's completion index current
+void save_rc_snapshot() {
+    if (rc_snapshot_active && path_index.generation() != rc_snapshot_index_generation) {
+        write_rc_snapshot();
+    }
+}
+
+// The benchmark harness includes this file with LITESHELL_NO_MAIN defined
+#ifndef LITESHELL_NO_MAIN
+
+// Read one line with readline. The main prompt is drawn by print_prompt;
+// continuation lines pass their own prompt. Returns false at EOF.
+static bool read_input_line(const char *continuation, string &line) {
+    // Readline runs in callback mode so SIGCHLD wakeups can be handled
+    // (and children reaped) while waiting for input
+    static char *input_cstr;
+    static bool line_ready;
+    line_ready = false;
+    rl_callback_handler_install(continuation ? continuation : "", [](char *text) {
+        rl_callback_handler_remove();
+        input_cstr = text;
+        line_ready = true;
+    });
+
+    while (!line_ready) {
+        struct pollfd fds[3] = {
+            {STDIN_FILENO, POLLIN, 0},
+            {sigchld_pipe[0], POLLIN, 0},
+            {output_collector.fd(), POLLIN, 0},
+        };
+        int ready = poll(fds, 3, -1);
+
+        if (sigint_received) {
+            sigint_received = 0;
+            cout << "\n";
+            rl_replace_line("", 0);
+            if (!continuation) print_prompt();
+            rl_on_new_line();
+            rl_redisplay();
         }
-        argv.push_back(nullptr);
-        
-        execvp(argv[0], argv.data());
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        perror("fork");
-        return -1;
-    } else {
-        if (!background) {
-            int status;
-            waitpid(pid, &status, 0);
-            reset_terminal();
-            return status;
-        } else {
-            cout << "[" << pid << "]" << endl;
-            return 0;
+        if (ready <= 0) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            reap_jobs();
         }
+        if (fds[2].revents & POLLIN) {
+            // Job output goes above the line being edited, which is redrawn
+            string out;
+            output_collector.collect(out);
+            if (!out.empty()) {
+                cout << "\r\033[K" << flush;
+                write_all(STDOUT_FILENO, out);
+                if (!continuation) print_prompt();
+                rl_on_new_line();
+                rl_redisplay();
+            }
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            rl_callback_read_char();
+        }
+    }
+
+    if (!input_cstr) {
+        return false;
     }
+    line = input_cstr;
+    free(input_cstr);
+    return true;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    // Builtins write to pipes from inside the shell; a closed reader must
+    // not kill it
+    signal(SIGPIPE, SIG_IGN);
+    shell_pid = getpid();
+    init_trace();
+
+    if (argc > 1 || !isatty(STDIN_FILENO)) {
+        interactive = false;
+    }
+    init_sigchld();
+    load_rc();
+
+    // Non-interactive modes: liteshell -c 'cmd', liteshell script, or a
+    // script piped into stdin
+    if (argc > 1) {
+        interactive = false;
+        string arg = argv[1];
+        if (arg == "-c") {
+            if (argc < 3) {
+                cerr << "liteshell: -c: option requires an argument" << endl;
+                return 2;
+            }
+            LineReader reader{string(argv[2])};
+            return run_script(reader) & 0xff;
+        }
+
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(argv[1]);
+            return 127;
+        }
+        LineReader reader(fd);
+        int code = run_script(reader);
+        close(fd);
+        return code & 0xff;
+    }
+
+    if (!isatty(STDIN_FILENO)) {
+        interactive = false;
+        LineReader reader(STDIN_FILENO);
+        return run_script(reader) & 0xff;
+    }
+
     // Setup terminal and signals
     setup_terminal();
     signal(SIGINT, sigint_handler);
     signal(SIGTSTP, SIG_IGN);
-    
-    string input;
-    vector<string> args;
-    int status = 0;
+    init_job_control();
+    init_prompt();
 
     // Initialize readline
     setup_readline();
+    refresh_path_index(chrono::milliseconds(0));
     
     // Load command history from file
     load_history();
     
     // Load aliases from file
-    ifstream alias_file(".myshell_aliases");
-    if (alias_file) {
-        string line;
-        while (getline(alias_file, line)) {
-            size_t pos = line.find('=');
-            if (pos != string::npos) {
-                string name = line.substr(0, pos);
-                string value = line.substr(pos + 1);
-                aliases[name] = value;
-            }
-        }
-    }
+    load_aliases();
 
     while (true) {
-        print_prompt();
-        char *input_cstr = readline("");
-        if (!input_cstr) {  // Handle EOF (Ctrl+D)
+        notify_jobs();
+        {
+            TraceScope trace(TracePhase::Prompt);
+            print_prompt();
+        }
+
+        string input;
+        if (!read_input_line(nullptr, input)) {  // Handle EOF (Ctrl+D)
             cout << endl;
-            handle_exit();
+            handle_exit({"exit"});
             break;
         }
-        
-        input = input_cstr;
-        free(input_cstr);
 
         // Skip empty input
         if (input.empty()) {
             continue;
         }
 
-        // Add command to history
-        add_to_history(input);
-
-        // Check for aliases
-        size_t first_space = input.find(' ');
-        string first_word = (first_space == string::npos) ? input : input.substr(0, first_space);
-        if (aliases.find(first_word) != aliases.end()) {
-            string replacement = aliases[first_word];
-            if (first_space != string::npos) {
-                replacement += input.substr(first_space);
-            }
-            input = replacement;
-        }
-
-        // Parse and execute command
-        args = parse_command(input);
-        
-        // Skip if no command was entered
-        if (args.empty()) {
-            continue;
-        }
-
-        // Execute the command
-        status = execute_command(args);
+        // Continuation lines are read by run_line, which hands back the
+        // whole command for history
+        last_status = run_line(input, [](string &more) { return read_input_line("> ", more); },
+                               add_to_history);
     }
-
     return 0;
-}
\ No newline at end of file
+}
+#endif  // LITESHELL_NO_MAIN
@@ -0,0 +1,87 @@
+#!/bin/sh
+# Regression tests for fixed bugs. Runs a built shell against small inputs
+# and compares what it prints.
+#
+#   g++ -std=c++17 -O2 -Wall liteshell.cpp -o liteshell -lreadline
+#   tests/regression.sh ./liteshell
+
+LSH=$(cd "$(dirname "${1:-./liteshell}")" && pwd)/$(basename "${1:-./liteshell}")
+WORK=$(mktemp -d /tmp/liteshell_tests.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+failures=0
+
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        echo "     expected: $2"
+        echo "     got:      $3"
+        failures=$((failures + 1))
+    fi
+}
+
+# An rc that runs a parallel block must not hang an interactive shell
+# before its first prompt
+mkdir rc_parallel
+printf 'parallel { true; }\n' > rc_parallel/.liteshellrc
+if command -v script > /dev/null; then
+    # The quotes keep the echoed input line from matching
+    out=$( (sleep 1; printf 'echo "prompt""-reached"\nexit\n') |
+          HOME="$WORK/rc_parallel" timeout 10 script -qc "$LSH" /dev/null 2>&1 |
+          grep -c 'prompt-reached')
+    check "rc parallel block, interactive" 1 "$out"
+else
+    echo "skip rc parallel block, interactive (no script(1))"
+fi
+out=$(HOME="$WORK/rc_parallel" timeout 10 "$LSH" -c 'echo ran')
+check "rc parallel block, -c" ran "$out"
+
+# A line of only assignments takes the status of its last substitution
+out=$("$LSH" -c 'out=$(false); echo $?; out=$(true); echo $?')
+check "assignment status from \$(false)" "1
+0" "$out"
+
+# $$ first expanded in a subshell is still the shell's own pid
+out=$("$LSH" -c 'x=$(echo $$ | cat); [ $x = $$ ] && echo same')
+check "\$\$ in a subshell" same "$out"
+
+# Only builtins without side effects run in-process for $(...)
+mkdir subst_alias
+out=$(HOME="$WORK/subst_alias" "$LSH" -c 'x=$(alias q=ls); alias')
+check "alias inside \$(...)" "" "$out"
+
+# Aliases defined by scripts and -c are not saved
+mkdir script_alias
+(cd script_alias && HOME="$WORK/script_alias" "$LSH" -c 'alias q=ls' > /dev/null)
+check "alias from -c not saved" no "$([ -e script_alias/.myshell_aliases ] && echo yes || echo no)"
+
+# Syntax errors give status 2, never a status outside 0..255
+printf 'echo a >\necho $?\n' > syntax.lsh
+check "syntax error status in a script" 2 "$("$LSH" syntax.lsh 2> /dev/null)"
+"$LSH" -c 'echo a |' 2> /dev/null
+check "syntax error exit status of -c" 2 "$?"
+
+# An empty stage on either side of | is a syntax error
+out=$("$LSH" -c '| echo hi' 2>&1; echo "status $?")
+check "leading |" "Syntax error: unexpected '|'
+status 2" "$out"
+out=$("$LSH" -c 'echo a | | echo b' 2>&1; echo "status $?")
+check "empty stage between |" "Syntax error: unexpected '|'
+status 2" "$out"
+
+# A closing keyword outside its construct is a syntax error
+out=$("$LSH" -c 'if true; then echo x; fi fi' 2>&1; echo "status $?")
+check "stray fi after if" "Syntax error: unexpected 'fi'
+status 2" "$out"
+out=$("$LSH" -c 'echo a; done' 2>&1; echo "status $?")
+check "done outside a loop" "Syntax error: unexpected 'done'
+status 2" "$out"
+
+# An out-of-range history count is an error, not an abort
+out=$("$LSH" -c 'history 99999999999; echo $?' 2>&1)
+check "history count out of range" "history: 99999999999: numeric argument required
+1" "$out"
+
+[ "$failures" -eq 0 ]